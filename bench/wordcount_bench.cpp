@@ -0,0 +1,463 @@
+// Throughput of the WordCount counters and readers on synthetic corpora.
+//
+//   wordcount_bench [--corpus=KIND,...] [--size=SIZE] [--repeat=N] [--dir=PATH]
+//   wordcount_bench --generate=KIND --size=SIZE FILE
+//
+// Corpora are generated from a fixed seed, so every run and every machine
+// counts the same bytes. Counters run over a corpus held in memory, once
+// for every instruction set the CPU supports; readers run over a file of
+// the corpus in --dir, which stays in the page cache between repeats. Both
+// hold at most 256M and are counted in as many passes as it takes to count
+// --size bytes. The uring reader is skipped where io_uring can not be set
+// up. The best of --repeat runs is reported, in GB/s and ns/byte.
+#include "wordcount_engine.h"
+#include <chrono>
+#include <iomanip>
+#include <sstream>
+
+using namespace std;
+
+static const vector<string> CorpusKinds = { "prose", "cyrillic", "json", "binary", "whitespace" };
+
+static const vector<pair<string, SimdLevel>> SimdLevels =
+{
+    { "scalar", SimdLevel::SCALAR },
+    { "sse2", SimdLevel::SSE2 },
+    { "avx2", SimdLevel::AVX2 },
+    { "avx512", SimdLevel::AVX512 }
+};
+
+static const vector<pair<string, IoMode>> IoModes =
+{
+    { "read", IoMode::READ },
+    { "mmap", IoMode::MMAP },
+    { "uring", IoMode::URING }
+};
+
+// Keeps the counts alive, so that no counting is optimized away
+static volatile unsigned long long Sink;
+
+// Counters and readers run over at most this much data, in as many passes
+// as it takes to count --size bytes
+static constexpr size_t MaxWindow = 256 << 20;
+
+// An endless deterministic stream of one kind of text, made a record at a
+// time so that the bytes do not depend on how they are taken
+class CorpusGenerator
+{
+private:
+    string kind;
+    unsigned long long state;
+    string pending;
+    size_t offset = 0;
+    vector<string> vocabulary;
+    unsigned long long records = 0;
+
+    // splitmix64
+    unsigned long long Next()
+    {
+        unsigned long long value = (state += 0x9E3779B97F4A7C15ULL);
+        value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        value = (value ^ (value >> 27)) * 0x94D049BB133111EBULL;
+        return value ^ (value >> 31);
+    }
+
+    size_t Below(size_t limit)
+    {
+        return static_cast<size_t>(Next() % limit);
+    }
+
+    // Skewed towards the start of the vocabulary, roughly like word
+    // frequencies of natural text
+    const string& Word()
+    {
+        double uniform = static_cast<double>(Next() >> 11) / static_cast<double>(1ULL << 53);
+        return vocabulary[static_cast<size_t>(uniform * uniform * uniform * static_cast<double>(vocabulary.size()))];
+    }
+
+    void MakeVocabulary(const vector<string>& syllables)
+    {
+        for (size_t index = 0; index < 2000; index++)
+        {
+            string word;
+            size_t length = 1 + Below(4);
+            for (size_t syllable = 0; syllable < length; syllable++)
+                word += syllables[Below(syllables.size())];
+            vocabulary.push_back(word);
+        }
+    }
+
+    // A paragraph of sentences wrapped at about 72 bytes
+    void Prose()
+    {
+        size_t sentences = 2 + Below(6);
+        size_t column = 0;
+        for (size_t sentence = 0; sentence < sentences; sentence++)
+        {
+            size_t words = 4 + Below(16);
+            for (size_t index = 0; index < words; index++)
+            {
+                string word = Word();
+                if (index == 0 && kind == "prose")
+                    word[0] = static_cast<char>(toupper(static_cast<unsigned char>(word[0])));
+                if (index + 1 == words)
+                    word += ".!?"[Below(3)];
+                else if (Below(10) == 0)
+                    word += ',';
+                if (column > 0 && column + word.length() > 72)
+                {
+                    pending += '\n';
+                    column = 0;
+                }
+                else if (column > 0)
+                {
+                    pending += ' ';
+                    column++;
+                }
+                pending += word;
+                column += word.length();
+            }
+        }
+        pending += "\n\n";
+    }
+
+    // One structured log record on a line of its own, some of them a few
+    // kilobytes long
+    void Json()
+    {
+        static const char* Levels[] = { "DEBUG", "INFO", "INFO", "INFO", "WARN", "ERROR" };
+        ostringstream record;
+        record << "{\"ts\":\"2024-01-" << setw(2) << setfill('0') << 1 + records / 86400000 % 28
+               << "T" << setw(2) << records / 3600000 % 24 << ":" << setw(2) << records / 60000 % 60
+               << ":" << setw(2) << records / 1000 % 60 << "." << setw(3) << records % 1000 << "Z\""
+               << ",\"level\":\"" << Levels[Below(6)] << "\",\"service\":\"svc-" << Below(32) << "\""
+               << ",\"trace\":\"" << hex << Next() << Next() << dec << "\",\"msg\":\"";
+        size_t words = 3 + Below(12);
+        for (size_t index = 0; index < words; index++)
+            record << (index ? " " : "") << Word();
+        record << "\",\"attrs\":{";
+        size_t attributes = Below(8) == 0 ? 40 + Below(200) : Below(8);
+        for (size_t index = 0; index < attributes; index++)
+            record << (index ? "," : "") << "\"" << Word() << "\":" << Next() % 100000;
+        record << "}}\n";
+        pending += record.str();
+        records += 1 + Below(50);
+    }
+
+    void Binary()
+    {
+        for (size_t index = 0; index < 512; index++)
+        {
+            unsigned long long value = Next();
+            pending.append(reinterpret_cast<const char*>(&value), sizeof(value));
+        }
+    }
+
+    // Words of one byte between runs of every kind of space, which makes
+    // word and line boundaries as dense and as unpredictable as they get
+    void Whitespace()
+    {
+        static const char Spaces[] = { ' ', '\t', '\n', '\r', '\v', '\f' };
+        for (size_t index = 0; index < 1024; index++)
+        {
+            size_t run = Below(4);
+            for (size_t space = 0; space < run; space++)
+                pending += Spaces[Below(sizeof(Spaces))];
+            pending += static_cast<char>('a' + Below(26));
+        }
+    }
+
+    void Refill()
+    {
+        pending.erase(0, offset);
+        offset = 0;
+        if (kind == "prose" || kind == "cyrillic")
+            Prose();
+        else if (kind == "json")
+            Json();
+        else if (kind == "binary")
+            Binary();
+        else
+            Whitespace();
+    }
+public:
+    CorpusGenerator(const string& kind, unsigned long long seed = 1)
+        : kind(kind), state(seed)
+    {
+        if (find(CorpusKinds.begin(), CorpusKinds.end(), kind) == CorpusKinds.end())
+            throw InvalidModifier("Unknown corpus: " + kind);
+        if (kind == "cyrillic")
+            MakeVocabulary({ "ра", "то", "ве", "ни", "ко", "ла", "ст", "мы", "же", "при", "об", "щи", "ю", "ь" });
+        else
+            MakeVocabulary({ "the", "an", "re", "in", "on", "er", "at", "st", "ing", "tion", "ou", "ea", "x", "q" });
+    }
+
+    void Fill(char* buffer, size_t size)
+    {
+        while (size > 0)
+        {
+            if (offset == pending.length())
+                Refill();
+            size_t length = min(size, pending.length() - offset);
+            memcpy(buffer, pending.data() + offset, length);
+            offset += length;
+            buffer += length;
+            size -= length;
+        }
+    }
+};
+
+struct Measurement
+{
+    string corpus;
+    string counter;
+    string backend;
+    unsigned long long bytes;
+    double seconds;
+};
+
+static string FormatSize(unsigned long long size)
+{
+    static const char* Suffixes[] = { "", "K", "M", "G" };
+    size_t suffix = 0;
+    while (suffix < 3 && size >= 1024 && size % 1024 == 0)
+    {
+        size /= 1024;
+        suffix++;
+    }
+    return to_string(size) + Suffixes[suffix];
+}
+
+static void Print(const Measurement& measurement)
+{
+    double bytes = static_cast<double>(measurement.bytes);
+    cout << left << setw(12) << measurement.corpus << setw(20) << measurement.counter << setw(10)
+         << measurement.backend << right << setw(8) << FormatSize(measurement.bytes) << fixed << setprecision(3)
+         << setw(10) << bytes / measurement.seconds / 1e9 << setw(10) << measurement.seconds * 1e9 / bytes << endl;
+}
+
+// Best time of repeat runs of a task
+template <typename Task>
+static double Best(unsigned repeat, Task task)
+{
+    double best = 0;
+    for (unsigned run = 0; run < repeat; run++)
+    {
+        auto start = chrono::steady_clock::now();
+        task();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        if (run == 0 || seconds < best)
+            best = seconds;
+    }
+    return best;
+}
+
+struct CounterCase
+{
+    string name;
+    vector<Options> options;
+    vector<string> patterns;
+};
+
+static vector<CounterCase> CounterCases(const string& corpus)
+{
+    vector<CounterCase> cases = {
+        { "lines", { Options::LINES }, {} },
+        { "words", { Options::WORDS }, {} },
+        { "chars", { Options::CHARS }, {} },
+        { "lines+words+chars", { Options::LINES, Options::WORDS, Options::CHARS }, {} },
+    };
+    // Patterns are taken from the corpus, so that they do occur in it
+    for (size_t length : { 1, 4, 16, 64 })
+    {
+        string pattern(length, '\0');
+        CorpusGenerator(corpus, 2).Fill(pattern.data(), length);
+        cases.push_back({ "substring/" + to_string(length), { Options::SUBSTRING }, { pattern } });
+    }
+    return cases;
+}
+
+static void BenchCounters(const string& corpus, unsigned long long size, unsigned repeat)
+{
+    size_t window = static_cast<size_t>(min<unsigned long long>(size, MaxWindow));
+    string data(window, '\0');
+    CorpusGenerator(corpus).Fill(data.data(), window);
+    unsigned long long passes = max(1ULL, size / window);
+    CountSettings settings;
+    for (const CounterCase& counterCase : CounterCases(corpus))
+    {
+        FileCounter prototype(counterCase.options, counterCase.patterns, settings);
+        for (const auto& pair_name_level : SimdLevels)
+        {
+            if (!SimdSupported(pair_name_level.second))
+                continue;
+            SelectKernels(pair_name_level.second);
+            double seconds = Best(repeat, [&]()
+            {
+                for (unsigned long long pass = 0; pass < passes; pass++)
+                {
+                    FileCounter counter = prototype;
+                    MappedReader reader(data.data(), data.size(), settings.bufferSize);
+                    counter.Count(reader);
+                    Sink = Sink + counter.GetCount(counterCase.options[0]);
+                }
+            });
+            Print({ corpus, counterCase.name, pair_name_level.first, passes * window, seconds });
+        }
+    }
+    SelectKernels(SimdLevel::AUTO);
+}
+
+static void Generate(const string& corpus, unsigned long long size, const string& path)
+{
+    ofstream out(path, ios::binary | ios::trunc);
+    if (!out)
+        throw InvalidModifier("Can not write " + path);
+    CorpusGenerator generator(corpus);
+    vector<char> buffer(1 << 20);
+    for (unsigned long long written = 0; written < size; written += buffer.size())
+    {
+        size_t length = static_cast<size_t>(min<unsigned long long>(buffer.size(), size - written));
+        generator.Fill(buffer.data(), length);
+        out.write(buffer.data(), static_cast<streamsize>(length));
+    }
+    if (!out.flush())
+        throw InvalidModifier("Can not write " + path);
+}
+
+// Whether io_uring can be set up here, so that the uring row does not
+// quietly measure the pread fallback
+static bool UringWorks(const string& path)
+{
+#ifdef WORDCOUNT_URING
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    CountSettings settings;
+    bool works = UringReader(fd, settings.bufferSize, settings.queueDepth, 0, 1).Start();
+    close(fd);
+    return works;
+#else
+    (void)path;
+    return false;
+#endif
+}
+
+// Lines only, the cheapest counter, so that the reader dominates. The file
+// is at most MaxWindow, read in as many passes as it takes to read --size
+// bytes
+static void BenchReaders(const string& corpus, unsigned long long size, unsigned repeat, const string& directory)
+{
+    unsigned long long window = min<unsigned long long>(size, MaxWindow);
+    unsigned long long passes = max(1ULL, size / window);
+    string path = directory + "/wordcount_bench_" + corpus + "_" + FormatSize(window);
+    try
+    {
+        Generate(corpus, window, path);
+        FileCounter prototype({ Options::LINES }, {}, CountSettings());
+        for (const auto& pair_name_mode : IoModes)
+        {
+            if (pair_name_mode.second == IoMode::URING && !UringWorks(path))
+            {
+                cerr << "Skipping uring: io_uring can not be set up here" << endl;
+                continue;
+            }
+            CountSettings settings;
+            settings.io = pair_name_mode.second;
+            double seconds = Best(repeat, [&]()
+            {
+                for (unsigned long long pass = 0; pass < passes; pass++)
+                {
+                    InputFile file;
+                    if (!file.Open(path, settings))
+                        throw InvalidModifier("Can not open " + path);
+                    FileCounter counter = prototype;
+                    counter.Count(*file.Read());
+                    if (file.ReadError() != 0)
+                        throw InvalidModifier("Can not read " + path + ": " + strerror(file.ReadError()));
+                    Sink = Sink + counter.GetCount(Options::LINES);
+                }
+            });
+            Print({ corpus, "lines", pair_name_mode.first, passes * window, seconds });
+        }
+    }
+    catch (...)
+    {
+        unlink(path.c_str());
+        throw;
+    }
+    unlink(path.c_str());
+}
+
+static vector<string> Split(const string& list)
+{
+    vector<string> items;
+    stringstream stream(list);
+    string item;
+    while (getline(stream, item, ','))
+    {
+        if (!item.empty())
+            items.push_back(item);
+    }
+    return items;
+}
+
+int main(int argc, char* argv[])
+{
+    setlocale(LC_ALL, "Russian");
+    InitCharTables();
+
+    vector<string> corpora = CorpusKinds;
+    unsigned long long size = 64 << 20;
+    unsigned repeat = 3;
+    string directory = "/tmp";
+    string generate;
+    string output;
+    try
+    {
+        for (int index = 1; index < argc; index++)
+        {
+            string arg = argv[index];
+            string value = arg.find('=') != string::npos ? arg.substr(arg.find('=') + 1) : "";
+            arg = arg.substr(0, arg.find('='));
+            if (arg == "--corpus")
+                corpora = Split(value);
+            else if (arg == "--size")
+                size = ParseSize(value, "--size");
+            else if (arg == "--repeat")
+                repeat = static_cast<unsigned>(max(1ULL, ParseSize(value, "--repeat")));
+            else if (arg == "--dir")
+                directory = value;
+            else if (arg == "--generate")
+                generate = value;
+            else if (arg[0] != '-' && output.empty())
+                output = arg;
+            else
+                throw InvalidModifier("Unknown argument: " + string(argv[index]));
+        }
+        if (size == 0)
+            throw InvalidModifier("Value for --size must be positive");
+        for (const string& corpus : corpora)
+            CorpusGenerator check(corpus);
+        if (!generate.empty())
+        {
+            if (output.empty())
+                throw InvalidModifier("--generate needs a file to write");
+            Generate(generate, size, output);
+            return 0;
+        }
+        cout << left << setw(12) << "corpus" << setw(20) << "counter" << setw(10) << "backend" << right << setw(8)
+             << "bytes" << setw(10) << "GB/s" << setw(10) << "ns/byte" << endl;
+        for (const string& corpus : corpora)
+        {
+            BenchCounters(corpus, size, repeat);
+            BenchReaders(corpus, size, repeat, directory);
+        }
+    }
+    catch (InvalidModifier& error)
+    {
+        cout << error.what() << endl;
+        return 1;
+    }
+    return 0;
+}
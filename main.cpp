@@ -1,26 +1,25 @@
-#include <iostream>
-#include <vector>
-#include <fstream>
-#include <map>
-#include <filesystem>
+#include "wordcount_engine.h"
+#include <iomanip>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <sys/resource.h>
 
-using namespace std;
+#if defined(__linux__) && __has_include(<sys/inotify.h>)
+#define WORDCOUNT_INOTIFY
+#include <sys/inotify.h>
+#include <poll.h>
+#include <chrono>
+#endif
 
-enum class Options
-{
-    LINES,
-    WORDS,
-    SUBSTRING,
-    CHARS,
-    BYTES
-};
+using namespace std;
 
 static map <char, Options> ShortOpt =
 {
     { 'l', Options::LINES },
     { 'w', Options::WORDS },
     { 'm', Options::CHARS },
-    { 'c', Options::BYTES }
+    { 'c', Options::BYTES },
+    { 'L', Options::MAX_LINE_LENGTH }
 };
 
 static map <string, Options> LongOpt =
@@ -29,7 +28,74 @@ static map <string, Options> LongOpt =
     { "--words", Options::WORDS },
     { "--chars", Options::CHARS },
     { "--bytes", Options::BYTES },
-    { "--substring", Options::SUBSTRING }
+    { "--substring", Options::SUBSTRING },
+    { "--freq", Options::FREQ },
+    { "--distinct-words", Options::DISTINCT_WORDS },
+    { "--distinct-lines", Options::DISTINCT_LINES },
+    { "--heavy-hitters", Options::HEAVY_WORDS },
+    { "--heavy-lines", Options::HEAVY_LINES },
+    { "--max-line-length", Options::MAX_LINE_LENGTH },
+    { "--line-length-histogram", Options::LINE_HISTOGRAM }
+};
+
+static map <string, Settings> LongSetting =
+{
+    { "--buffer-size", Settings::BUFFER_SIZE },
+    { "--io", Settings::IO },
+    { "--simd", Settings::SIMD },
+    { "--jobs", Settings::JOBS },
+    { "--substrings-from", Settings::SUBSTRINGS_FROM },
+    { "--encoding", Settings::ENCODING },
+    { "--queue-depth", Settings::QUEUE_DEPTH },
+    { "--recursive", Settings::RECURSIVE },
+    { "--include", Settings::INCLUDE },
+    { "--exclude", Settings::EXCLUDE },
+    { "--cache", Settings::CACHE },
+    { "--cache-size", Settings::CACHE_SIZE },
+    { "--checkpoints", Settings::CHECKPOINTS },
+    { "--follow", Settings::FOLLOW },
+    { "--interval", Settings::INTERVAL },
+    { "--hll-precision", Settings::HLL_PRECISION },
+    { "--heavy-memory", Settings::HEAVY_MEMORY },
+    { "--decompress", Settings::DECOMPRESS },
+    { "--stats", Settings::STATS }
+};
+
+static map <char, Settings> ShortSetting =
+{
+    { 'j', Settings::JOBS }
+};
+
+// Settings that take no value
+static map <char, Settings> ShortFlag =
+{
+    { 'r', Settings::RECURSIVE },
+    { 'f', Settings::FOLLOW }
+};
+
+static map <string, IoMode> IoModeName =
+{
+    { "auto", IoMode::AUTO },
+    { "read", IoMode::READ },
+    { "mmap", IoMode::MMAP },
+    { "uring", IoMode::URING }
+};
+
+static map <string, SimdLevel> SimdLevelName =
+{
+    { "auto", SimdLevel::AUTO },
+    { "scalar", SimdLevel::SCALAR },
+    { "sse2", SimdLevel::SSE2 },
+    { "avx2", SimdLevel::AVX2 },
+    { "avx512", SimdLevel::AVX512 }
+};
+
+static map <string, Encoding> EncodingName =
+{
+    { "utf8", Encoding::UTF8 },
+    { "utf-8", Encoding::UTF8 },
+    { "cp1251", Encoding::CP1251 },
+    { "windows-1251", Encoding::CP1251 }
 };
 
 static map <Options, string> OptName =
@@ -38,22 +104,33 @@ static map <Options, string> OptName =
     { Options::WORDS, "Words" },
     { Options::CHARS, "Chars" },
     { Options::BYTES, "Bytes" },
-    { Options::SUBSTRING, "Substring" }
+    { Options::SUBSTRING, "Substring" },
+    { Options::FREQ, "Word" },
+    { Options::DISTINCT_WORDS, "Distinct words" },
+    { Options::DISTINCT_LINES, "Distinct lines" },
+    { Options::HEAVY_WORDS, "Heavy word" },
+    { Options::HEAVY_LINES, "Heavy line" },
+    { Options::MAX_LINE_LENGTH, "Max line length" },
+    { Options::LINE_HISTOGRAM, "Line length" },
+    { Options::COMPRESSED_BYTES, "Compressed bytes" }
 };
 
-class InvalidModifier: public exception
+static map <Kernel, string> KernelName =
 {
-private:
-    string message_error;
-public:
-    explicit InvalidModifier(const string& message_error)
-        : message_error(message_error)
-    {
-    }
-    const string& what()
-    {
-        return message_error;
-    }
+    { Kernel::WORD_TOKENS, "Word tokens" },
+    { Kernel::LINE_TOKENS, "Line tokens" },
+    { Kernel::LINE_LENGTHS, "Line lengths" },
+    { Kernel::LINES, "Lines" },
+    { Kernel::WORDS, "Words" },
+    { Kernel::CHARS, "Chars" },
+    { Kernel::SUBSTRINGS, "Substrings" }
+};
+
+static map <HwEvent, string> HwEventName =
+{
+    { HwEvent::BRANCH_MISSES, "branch misses" },
+    { HwEvent::CACHE_MISSES, "cache misses" },
+    { HwEvent::LLC_LOADS, "LLC loads" }
 };
 
 class OptionsParser
@@ -61,7 +138,9 @@ class OptionsParser
 private:
     vector<string> filenames;
     vector<Options> options;
-    map<Options, string> modifiers;
+    map<Options, vector<string>> modifiers;
+    // Every value of a setting in command-line order; most use the last one
+    map<Settings, vector<string>> settings;
 
     void AddDefaultOpt()
     {
@@ -72,7 +151,8 @@ private:
 
     void OptionParse(char* argv[], int& indargv)
     {
-        if (argv[indargv][0] != '-')
+        // A lone "-" names standard input
+        if (argv[indargv][0] != '-' || argv[indargv][1] == '\0')
         {
             filenames.push_back(static_cast<string>(argv[indargv]));
         }
@@ -83,15 +163,47 @@ private:
             {
                 string modifier = arg.substr(arg.find('=') + 1);
                 arg = arg.substr(0, arg.find('='));
-                modifiers[LongOpt[arg]] = modifier;
+                if (LongSetting.count(arg))
+                {
+                    settings[LongSetting[arg]].push_back(modifier);
+                    // Patterns from a file are counted like --substring ones
+                    if (LongSetting[arg] == Settings::SUBSTRINGS_FROM)
+                        options.push_back(Options::SUBSTRING);
+                    return;
+                }
+                modifiers[LongOpt[arg]].push_back(modifier);
+            }
+            else if (LongSetting.count(arg))
+            {
+                settings[LongSetting[arg]].push_back("");
+                return;
             }
             options.push_back(LongOpt[arg]);
         }
         else
         {
             string args = static_cast<string>(argv[indargv]).erase(0, 1);
-            for (char arg : args)
+            for (size_t pos = 0; pos < args.length(); pos++)
+            {
+                char arg = args[pos];
+                if (ShortFlag.count(arg))
+                {
+                    settings[ShortFlag[arg]].push_back("");
+                    continue;
+                }
+                if (ShortSetting.count(arg))
+                {
+                    // The value is either the rest of this argument or the next one
+                    if (pos + 1 < args.length())
+                        settings[ShortSetting[arg]].push_back(args.substr(pos + 1));
+                    else if (argv[indargv + 1] != nullptr)
+                        settings[ShortSetting[arg]].push_back(argv[++indargv]);
+                    else
+                        settings[ShortSetting[arg]].push_back("");
+                    return;
+                }
                 options.push_back(ShortOpt[arg]);
+            }
         }
     }
 public:
@@ -113,170 +225,912 @@ public:
         return filenames;
     }
 
-    const map<Options, string>& GetModifiers()
+    const map<Options, vector<string>>& GetModifiers()
     {
         return modifiers;
     }
+
+    const map<Settings, vector<string>>& GetSettings()
+    {
+        return settings;
+    }
 };
 
-void WriteFileData(const string& filename, const map<Options, unsigned long long>& filedata)
+// Every --substring modifier followed by the lines of --substrings-from
+vector<string> LoadPatterns(const map<Options, vector<string>>& modifiers, const map<Settings, vector<string>>& settings)
 {
-    cout << endl << filename << endl;
-    for (auto pair_option_count : filedata)
+    vector<string> patterns;
+    if (modifiers.count(Options::SUBSTRING))
+        patterns = modifiers.at(Options::SUBSTRING);
+    for (const string& pattern : patterns)
     {
-        cout << OptName[pair_option_count.first] << ": " << pair_option_count.second << endl;
+        if (pattern.empty())
+            throw InvalidModifier("Modifier for --substring can not be empty");
+    }
+    if (!settings.count(Settings::SUBSTRINGS_FROM))
+        return patterns;
+    for (const string& filename : settings.at(Settings::SUBSTRINGS_FROM))
+    {
+        ifstream fin(filename);
+        if (fin.fail())
+            throw InvalidModifier("File for --substrings-from can not be opened");
+        string pattern;
+        while (getline(fin, pattern))
+        {
+            if (!pattern.empty() && pattern.back() == '\r')
+                pattern.pop_back();
+            if (!pattern.empty())
+                patterns.push_back(pattern);
+        }
     }
+    return patterns;
 }
 
-void SetStreamDefault(ifstream& fin)
+// The K of --freq=K and the like, ten items when it is not given
+size_t ParseTop(const map<Options, vector<string>>& modifiers, Options option, const string& name, size_t limit)
 {
-    fin.clear();
-    fin.seekg(0);
+    if (!modifiers.count(option))
+        return 10;
+    unsigned long long top = ParseSize(modifiers.at(option).back(), name);
+    if (top < 1 || top > limit)
+        throw InvalidModifier("Value for " + name + " must be between 1 and " + to_string(limit));
+    return static_cast<size_t>(top);
 }
 
-unsigned long long LinesCount(ifstream& fin)
+CountSettings ParseSettings(const map<Settings, vector<string>>& settings)
 {
-    unsigned long long count = 0;
-    char sim;
-    while (!(fin.eof()))
+    CountSettings parsed;
+    if (settings.count(Settings::BUFFER_SIZE))
+    {
+        unsigned long long size = ParseSize(settings.at(Settings::BUFFER_SIZE).back(), "--buffer-size");
+        if (size < 4096 || size > (1ULL << 30))
+            throw InvalidModifier("Value for --buffer-size must be between 4K and 1G");
+        parsed.bufferSize = static_cast<size_t>(size);
+    }
+    if (settings.count(Settings::IO))
+    {
+        if (!IoModeName.count(settings.at(Settings::IO).back()))
+            throw InvalidModifier("Invalid value for --io: " + settings.at(Settings::IO).back());
+        parsed.io = IoModeName.at(settings.at(Settings::IO).back());
+    }
+    if (settings.count(Settings::SIMD))
+    {
+        if (!SimdLevelName.count(settings.at(Settings::SIMD).back()))
+            throw InvalidModifier("Invalid value for --simd: " + settings.at(Settings::SIMD).back());
+        parsed.simd = SimdLevelName.at(settings.at(Settings::SIMD).back());
+    }
+    if (settings.count(Settings::JOBS))
+    {
+        unsigned long long jobs = ParseSize(settings.at(Settings::JOBS).back(), "-j");
+        if (jobs < 1 || jobs > 1024)
+            throw InvalidModifier("Value for -j must be between 1 and 1024");
+        parsed.jobs = static_cast<unsigned>(jobs);
+    }
+    if (settings.count(Settings::ENCODING))
+    {
+        if (!EncodingName.count(settings.at(Settings::ENCODING).back()))
+            throw InvalidModifier("Invalid value for --encoding: " + settings.at(Settings::ENCODING).back());
+        parsed.encoding = EncodingName.at(settings.at(Settings::ENCODING).back());
+    }
+    if (settings.count(Settings::QUEUE_DEPTH))
+    {
+        unsigned long long depth = ParseSize(settings.at(Settings::QUEUE_DEPTH).back(), "--queue-depth");
+        if (depth < 1 || depth > 4096)
+            throw InvalidModifier("Value for --queue-depth must be between 1 and 4096");
+        parsed.queueDepth = static_cast<unsigned>(depth);
+    }
+    if (settings.count(Settings::CACHE))
+    {
+        parsed.cache = settings.at(Settings::CACHE).back();
+        if (parsed.cache.empty())
+            throw InvalidModifier("Modifier for --cache can not be empty");
+    }
+    if (settings.count(Settings::CACHE_SIZE))
+    {
+        parsed.cacheSize = ParseSize(settings.at(Settings::CACHE_SIZE).back(), "--cache-size");
+        if (parsed.cacheSize < (64 << 10) || parsed.cacheSize > (4ULL << 30))
+            throw InvalidModifier("Value for --cache-size must be between 64K and 4G");
+    }
+    if (settings.count(Settings::CHECKPOINTS))
     {
-        sim = static_cast<char>(fin.get());
-        if (sim == '\n' || sim == EOF)
-            count++;
+        parsed.checkpoints = settings.at(Settings::CHECKPOINTS).back();
+        struct stat info;
+        if (stat(parsed.checkpoints.c_str(), &info) != 0 || !S_ISDIR(info.st_mode))
+            throw InvalidModifier("Directory for --checkpoints can not be opened");
     }
-    SetStreamDefault(fin);
-    return count;
+    if (settings.count(Settings::HLL_PRECISION))
+    {
+        unsigned long long precision = ParseSize(settings.at(Settings::HLL_PRECISION).back(), "--hll-precision");
+        if (precision < 4 || precision > 18)
+            throw InvalidModifier("Value for --hll-precision must be between 4 and 18");
+        parsed.hllPrecision = static_cast<unsigned>(precision);
+    }
+    if (settings.count(Settings::HEAVY_MEMORY))
+    {
+        unsigned long long memory = ParseSize(settings.at(Settings::HEAVY_MEMORY).back(), "--heavy-memory");
+        if (memory < (1 << 20) || memory > (1ULL << 32))
+            throw InvalidModifier("Value for --heavy-memory must be between 1M and 4G");
+        parsed.heavyMemory = static_cast<size_t>(memory);
+    }
+    if (settings.count(Settings::DECOMPRESS))
+    {
+        const string& value = settings.at(Settings::DECOMPRESS).back();
+        if (value != "auto" && value != "none")
+            throw InvalidModifier("Invalid value for --decompress: " + value);
+        parsed.decompress = value == "auto";
+    }
+    if (settings.count(Settings::STATS))
+    {
+        const string& value = settings.at(Settings::STATS).back();
+        if (!value.empty() && value != "hw")
+            throw InvalidModifier("Invalid value for --stats: " + value);
+        parsed.stats = true;
+        parsed.hardwareStats = value == "hw";
+    }
+    parsed.follow = settings.count(Settings::FOLLOW) > 0;
+#ifndef WORDCOUNT_INOTIFY
+    if (parsed.follow)
+        throw InvalidModifier("--follow is not supported on this system");
+#endif
+    if (settings.count(Settings::INTERVAL))
+    {
+        const string& value = settings.at(Settings::INTERVAL).back();
+        size_t pos = 0;
+        try
+        {
+            parsed.interval = stod(value, &pos);
+        }
+        catch (logic_error&)
+        {
+            pos = 0;
+        }
+        if (pos == 0 || pos != value.length() || !(parsed.interval >= 0 && parsed.interval <= 86400))
+            throw InvalidModifier("Value for --interval must be between 0 and 86400 seconds");
+    }
+    parsed.recursive = settings.count(Settings::RECURSIVE) > 0;
+    if (settings.count(Settings::INCLUDE))
+        parsed.include = settings.at(Settings::INCLUDE);
+    if (settings.count(Settings::EXCLUDE))
+        parsed.exclude = settings.at(Settings::EXCLUDE);
+    return parsed;
 }
 
-unsigned long long WordsCount(ifstream& fin)
+// With several patterns every one of them gets its own Substring line;
+// chars of a file that is not valid UTF-8 are followed by a warning, and
+// --freq and --heavy-* list their items with their counts, and
+// --line-length-histogram its buckets and percentiles
+void WriteFileData(const string& filename, const map<Options, unsigned long long>& filedata,
+                   const vector<string>& patterns, const vector<unsigned long long>& substrings,
+                   bool utf8Valid, const map<Options, RankedItems>& ranked, const LengthHistogram& lengths)
 {
-    unsigned long long count = 0;
-    char sim;
-    bool isempty = false;
-    while (!fin.eof())
+    cout << endl << filename << endl;
+    for (auto pair_option_count : filedata)
     {
-        sim = static_cast<char>(fin.get());
-        if (isspace(sim) || sim == EOF)
+        Options option = pair_option_count.first;
+        if (option == Options::LINE_HISTOGRAM)
         {
-            if(isempty)
-                count++;
-            isempty = false;
-        } else
+            for (const auto& pair_range_count : lengths.Powers())
+                cout << OptName[option] << " " << pair_range_count.first << ": " << pair_range_count.second << endl;
+            cout << OptName[option] << " p50: " << lengths.Percentile(0.5) << endl;
+            cout << OptName[option] << " p99: " << lengths.Percentile(0.99) << endl;
+            cout << OptName[option] << " max: " << lengths.Max() << endl;
+            continue;
+        }
+        if (option == Options::FREQ || option == Options::HEAVY_WORDS || option == Options::HEAVY_LINES)
+        {
+            if (!ranked.count(option))
+                continue;
+            const RankedItems& list = ranked.at(option);
+            for (const auto& pair_item_count : list.items)
+            {
+                cout << OptName[option] << " \"" << pair_item_count.first << "\": " << pair_item_count.second;
+                if (list.error > 0)
+                    cout << " (error <= " << list.error << ")";
+                cout << endl;
+            }
+            continue;
+        }
+        if (pair_option_count.first == Options::SUBSTRING && patterns.size() > 1)
         {
-            isempty = true;
+            for (size_t index = 0; index < patterns.size(); index++)
+                cout << OptName[Options::SUBSTRING] << " \"" << patterns[index] << "\": " << substrings[index] << endl;
+            continue;
         }
+        cout << OptName[pair_option_count.first] << ": " << pair_option_count.second << endl;
+        if (pair_option_count.first == Options::CHARS && !utf8Valid)
+            cout << "Invalid UTF-8 sequences found" << endl;
     }
-    SetStreamDefault(fin);
-    return count;
 }
 
-unsigned long long CharsCount(ifstream& fin)
+// Cycles per byte and IPC of a counter pass, then its raw event counts;
+// events the system could not count are left out
+void WriteHwEvents(const atomic<unsigned long long> (&events)[HwEventCount], unsigned long long bytes)
 {
-    unsigned long long count = 0;
-    char sim;
-    while (!(fin.eof()))
+    unsigned opened = HwEventsOpened;
+    auto has = [opened](HwEvent event) { return opened & (1u << static_cast<size_t>(event)); };
+    unsigned long long cycles = events[static_cast<size_t>(HwEvent::CYCLES)];
+    unsigned long long instructions = events[static_cast<size_t>(HwEvent::INSTRUCTIONS)];
+    cerr << fixed << setprecision(3);
+    if (has(HwEvent::CYCLES) && bytes > 0)
+        cerr << ", " << static_cast<double>(cycles) / static_cast<double>(bytes) << " cycles/byte";
+    if (has(HwEvent::CYCLES) && has(HwEvent::INSTRUCTIONS) && cycles > 0)
+        cerr << ", IPC " << static_cast<double>(instructions) / static_cast<double>(cycles);
+    cerr.unsetf(ios::floatfield);
+    for (const auto& pair_event_name : HwEventName)
     {
-        sim = static_cast<char>(fin.get());
-        if (isprint(sim))
-            count++;
+        if (has(pair_event_name.first))
+            cerr << ", " << events[static_cast<size_t>(pair_event_name.first)] << " " << pair_event_name.second;
     }
-    SetStreamDefault(fin);
-    return count;
 }
 
-unsigned long long SubstringCount(ifstream& fin, const string& modifier)
+// The --stats report of a file or of the whole run, on stderr so that it
+// does not mix with the counts
+void WriteStats(const string& name, const FileStats& stats)
 {
-    unsigned long long count = 0;
-    char sim;
-    string substring;
-    while (!(fin.eof()))
+    auto seconds = [](unsigned long long nanoseconds) { return to_string(nanoseconds / 1e9) + " s"; };
+    cerr << endl << name << " (stats)" << endl;
+    cerr << "Wall time: " << seconds(stats.wall) << endl;
+    cerr << "Open/stat: " << seconds(stats.open) << endl;
+    cerr << "Read/wait: " << seconds(stats.wait) << endl;
+    for (size_t kernel = 0; kernel < KernelCount; kernel++)
     {
-        sim = static_cast<char>(fin.get());
-        if (modifier.empty())
+        if (stats.kernels[kernel] > 0)
         {
-            throw InvalidModifier("Modifier for --substring can not be empty");
+            cerr << "Kernel " << KernelName[static_cast<Kernel>(kernel)] << ": " << seconds(stats.kernels[kernel]);
+            if (stats.hardware)
+                WriteHwEvents(stats.events[kernel], stats.bytes);
+            cerr << endl;
         }
-        else
+    }
+    cerr << "Output: " << seconds(stats.output) << endl;
+    cerr << "Bytes read: " << stats.bytes << endl;
+    if (stats.wall > 0)
+        cerr << "Bytes/s: " << static_cast<unsigned long long>(stats.bytes * 1e9 / stats.wall) << endl;
+    cerr << "Read syscalls: " << stats.syscalls << endl;
+    cerr << "Buffer refills: " << stats.refills << endl;
+}
+
+// Sums the stats of a file into those of the run
+void AddStats(FileStats& total, const FileStats& stats)
+{
+    total.open += stats.open;
+    total.wait += stats.wait;
+    for (size_t kernel = 0; kernel < KernelCount; kernel++)
+    {
+        total.kernels[kernel] += stats.kernels[kernel];
+        for (size_t event = 0; event < HwEventCount; event++)
+            total.events[kernel][event] += stats.events[kernel][event];
+    }
+    total.output += stats.output;
+    total.syscalls += stats.syscalls;
+    total.refills += stats.refills;
+    total.bytes += stats.bytes;
+}
+
+void WriteFailFileOpened(const string& filename)
+{
+    cout << endl << filename << endl;
+    cout << "File can not be opened" << endl;
+}
+
+// Counts that a failed read cut short are not printed
+void WriteFailFileRead(const string& filename, int error)
+{
+    cout << endl << filename << endl;
+    cout << "File can not be read: " << strerror(error) << endl;
+}
+
+// Lists directories for -r on a thread pool. Every listed directory
+// submits its subdirectories right away, so the whole tree is read in
+// parallel while the caller waits only for the directory it needs next.
+class DirectoryWalker
+{
+public:
+    struct Directory
+    {
+        string path;
+        bool listed = false;
+        bool opened = false;
+        // Both in name order
+        vector<string> files;
+        vector<shared_ptr<Directory>> subdirectories;
+    };
+private:
+    const CountSettings& settings;
+    mutex lock;
+    condition_variable listed;
+    ThreadPool pool;
+
+    bool Matches(const vector<string>& globs, const char* name) const
+    {
+        for (const string& glob : globs)
         {
-            if (substring.length() == modifier.length())
+            if (fnmatch(glob.c_str(), name, 0) == 0)
+                return true;
+        }
+        return false;
+    }
+
+    static string Join(const string& directory, const char* name)
+    {
+        if (!directory.empty() && directory.back() == '/')
+            return directory + name;
+        return directory + "/" + name;
+    }
+
+    // Symbolic links are followed to files but not to directories, which
+    // keeps the walk free of cycles
+    void List(const shared_ptr<Directory>& directory)
+    {
+        vector<string> files;
+        vector<string> subdirectories;
+        DIR* stream = opendir(directory->path.c_str());
+        if (stream)
+        {
+            while (dirent* entry = readdir(stream))
             {
-                if (substring == modifier)
-                    count++;
-                substring = substring.erase(0, 1);
+                const char* name = entry->d_name;
+                if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || Matches(settings.exclude, name))
+                    continue;
+                unsigned char type = entry->d_type;
+                if (type == DT_UNKNOWN || type == DT_LNK)
+                {
+                    struct stat info;
+                    if (fstatat(dirfd(stream), name, &info, type == DT_LNK ? 0 : AT_SYMLINK_NOFOLLOW) != 0)
+                        continue;
+                    if (S_ISREG(info.st_mode))
+                        type = DT_REG;
+                    else if (S_ISDIR(info.st_mode) && type == DT_UNKNOWN)
+                        type = DT_DIR;
+                }
+                if (type == DT_DIR)
+                    subdirectories.push_back(Join(directory->path, name));
+                else if (type == DT_REG && (settings.include.empty() || Matches(settings.include, name)))
+                    files.push_back(Join(directory->path, name));
             }
-            substring += sim;
+            closedir(stream);
         }
+        sort(files.begin(), files.end());
+        sort(subdirectories.begin(), subdirectories.end());
+        vector<shared_ptr<Directory>> children;
+        for (string& path : subdirectories)
+        {
+            children.push_back(make_shared<Directory>());
+            children.back()->path = move(path);
+        }
+        {
+            lock_guard<mutex> guard(lock);
+            directory->opened = stream != nullptr;
+            directory->files = move(files);
+            directory->subdirectories = children;
+            directory->listed = true;
+        }
+        listed.notify_all();
+        for (const shared_ptr<Directory>& child : children)
+            pool.Submit([this, child]() { List(child); });
+    }
+public:
+    DirectoryWalker(const CountSettings& settings)
+        : settings(settings), pool(max(settings.jobs, 4u))
+    {
     }
-    SetStreamDefault(fin);
-    return count;
-}
 
-unsigned long long BytesCount(const string& filename)
-{
-    return filesystem::file_size(filename);
-}
+    shared_ptr<Directory> Walk(const string& path)
+    {
+        auto directory = make_shared<Directory>();
+        directory->path = path;
+        pool.Submit([this, directory]() { List(directory); });
+        return directory;
+    }
+
+    void Wait(const Directory& directory)
+    {
+        unique_lock<mutex> guard(lock);
+        listed.wait(guard, [&directory]() { return directory.listed; });
+    }
+};
 
-unsigned long long ChooseCounter(Options option, const string& modifier, const string& filename, ifstream& fin)
+// The inputs in output order: filenames as given and, with -r, the files
+// of every directory in name order with markers around each directory so
+// that its subtotal can follow its contents.
+class InputList
 {
-    switch (option)
-    {
-        case Options::LINES:
-            return LinesCount(fin);
-        case Options::WORDS:
-            return WordsCount(fin);
-        case Options::SUBSTRING:
-            try
+public:
+    enum class Kind
+    {
+        FILE,
+        ENTER,
+        LEAVE,
+        UNREADABLE
+    };
+
+    struct Entry
+    {
+        Kind kind;
+        string path;
+    };
+private:
+    struct Frame
+    {
+        shared_ptr<DirectoryWalker::Directory> directory;
+        bool entered = false;
+        size_t file = 0;
+        size_t subdirectory = 0;
+    };
+
+    const vector<string>& filenames;
+    size_t next = 0;
+    bool recursive;
+    DirectoryWalker walker;
+    vector<Frame> stack;
+
+    static bool IsDirectory(const string& path)
+    {
+        struct stat info;
+        return stat(path.c_str(), &info) == 0 && S_ISDIR(info.st_mode);
+    }
+public:
+    InputList(const vector<string>& filenames, const CountSettings& settings)
+        : filenames(filenames), recursive(settings.recursive), walker(settings)
+    {
+    }
+
+    bool Next(Entry& entry)
+    {
+        while (!stack.empty())
+        {
+            Frame& frame = stack.back();
+            const DirectoryWalker::Directory& directory = *frame.directory;
+            if (!frame.entered)
             {
-                return SubstringCount(fin, modifier);
+                walker.Wait(directory);
+                frame.entered = true;
+                if (!directory.opened)
+                {
+                    entry = { Kind::UNREADABLE, directory.path };
+                    stack.pop_back();
+                    return true;
+                }
+                entry = { Kind::ENTER, directory.path };
+                return true;
             }
-            catch (InvalidModifier& error)
+            if (frame.file < directory.files.size())
             {
-                cout << error.what() << endl;
-                exit(0);
+                entry = { Kind::FILE, directory.files[frame.file++] };
+                return true;
             }
-        case Options::CHARS:
-            return CharsCount(fin);
-        case Options::BYTES:
-            return BytesCount(filename);
+            if (frame.subdirectory < directory.subdirectories.size())
+            {
+                stack.push_back({ directory.subdirectories[frame.subdirectory++] });
+                continue;
+            }
+            entry = { Kind::LEAVE, directory.path };
+            stack.pop_back();
+            return true;
+        }
+        if (next >= filenames.size())
+            return false;
+        const string& filename = filenames[next++];
+        if (recursive && filename != StdinName && IsDirectory(filename))
+        {
+            stack.push_back({ walker.Walk(filename) });
+            return Next(entry);
+        }
+        entry = { Kind::FILE, filename };
+        return true;
     }
-}
+};
 
-string GetModifier(const map<Options, string>& modifiers, Options option)
+// Sums of the printed counts of every file under one directory
+struct Subtotal
 {
-    if (modifiers.count(option))
-        return modifiers.at(option);
-    else
-        return "";
-}
+    map<Options, unsigned long long> filedata;
+    vector<unsigned long long> substrings;
+    bool utf8Valid = true;
+    // Distinct counts and heavy hitters do not add up, their sketches
+    // merge instead
+    map<Options, HyperLogLog> sketches;
+    map<Options, HeavyHitters> hitters;
+    map<Options, RankedItems> ranked;
+    LengthHistogram lengths;
 
-void WriteFailFileOpened(const string& filename)
+    Subtotal(const vector<Options>& options, size_t patterns)
+        : substrings(patterns, 0)
+    {
+        for (Options option : options)
+            filedata[option] = 0;
+    }
+
+    void Add(const map<Options, unsigned long long>& data, const vector<unsigned long long>& counts, bool valid,
+             const map<Options, HyperLogLog>& fileSketches, const map<Options, HeavyHitters>& fileHitters,
+             const LengthHistogram& fileLengths)
+    {
+        for (auto pair_option_count : data)
+            filedata[pair_option_count.first] += pair_option_count.second;
+        for (size_t index = 0; index < counts.size() && index < substrings.size(); index++)
+            substrings[index] += counts[index];
+        utf8Valid = utf8Valid && valid;
+        for (const auto& pair_option_sketch : fileSketches)
+            sketches[pair_option_sketch.first].Merge(pair_option_sketch.second);
+        for (const auto& pair_option_hitters : fileHitters)
+            hitters[pair_option_hitters.first].Merge(pair_option_hitters.second);
+        lengths.Merge(fileLengths);
+    }
+
+    // Settles what does not add up across files once all of them are added
+    void Close(const CountSettings& settings)
+    {
+        for (const auto& pair_option_sketch : sketches)
+            filedata[pair_option_sketch.first] = pair_option_sketch.second.Estimate();
+        for (const auto& pair_option_hitters : hitters)
+        {
+            size_t top = pair_option_hitters.first == Options::HEAVY_WORDS ? settings.topHeavyWords : settings.topHeavyLines;
+            ranked[pair_option_hitters.first] = pair_option_hitters.second.Top(top);
+        }
+        if (filedata.count(Options::MAX_LINE_LENGTH))
+            filedata[Options::MAX_LINE_LENGTH] = lengths.Max();
+    }
+};
+
+#ifdef WORDCOUNT_INOTIFY
+// Goes on counting regular files after the first pass for --follow. It
+// sleeps in poll(2) on an inotify descriptor until a file is written to,
+// then counts just the bytes past what it has seen and merges them into
+// the saved state. A truncated file is counted again from the start; one
+// that was moved or deleted is reopened by name once it appears again.
+class Follower
 {
-    cout << endl << filename << endl;
-    cout << "File can not be opened" << endl;
-}
+private:
+    static constexpr uint32_t Events = IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF;
+
+    struct Followed
+    {
+        FileResult result;
+        unsigned long long offset = 0;
+        int watch = -1;
+        bool changed = false;
+        bool lost = false;
+    };
+
+    const FileCounter& prototype;
+    const vector<Options>& options;
+    const vector<string>& patterns;
+    const CountSettings& settings;
+    int notify;
+    vector<Followed> files;
+
+    void Update(Followed& followed)
+    {
+        InputFile& file = *followed.result.file;
+        if (!file.Refresh())
+            return;
+        if (file.Info().st_nlink == 0)
+        {
+            followed.lost = true;
+            return;
+        }
+        unsigned long long size = file.Size();
+        if (size == followed.offset)
+            return;
+        FileCounter& counter = *followed.result.counter;
+        if (size < followed.offset)
+        {
+            counter = prototype;
+            followed.offset = 0;
+        }
+        if (counter.NeedsScan() && size > followed.offset)
+        {
+            FileCounter grown = prototype;
+            unique_ptr<InputReader> reader = file.Read(followed.offset, size);
+            grown.Count(*reader);
+            // After a failed read the file is opened again like a moved one
+            if (file.ReadError())
+            {
+                inotify_rm_watch(notify, followed.watch);
+                followed.lost = true;
+                return;
+            }
+            counter.Merge(grown);
+        }
+        followed.offset = size;
+        followed.changed = true;
+    }
 
+    void Reopen(Followed& followed)
+    {
+        auto file = make_shared<InputFile>();
+        if (!file->Open(followed.result.filename, settings) || !file->IsRegular() || file->IsCompressed())
+            return;
+        followed.watch = inotify_add_watch(notify, followed.result.filename.c_str(), Events);
+        followed.result.file = move(file);
+        followed.result.counter = make_shared<FileCounter>(prototype);
+        followed.offset = 0;
+        followed.lost = false;
+        // Even an empty new file is worth an update, since the counts dropped
+        followed.changed = true;
+        Update(followed);
+    }
+
+    // Returns whether there was anything to print
+    bool Print()
+    {
+        bool printed = false;
+        for (Followed& followed : files)
+        {
+            if (!followed.changed)
+                continue;
+            printed = true;
+            followed.changed = false;
+            const FileCounter& counter = *followed.result.counter;
+            map<Options, unsigned long long> filedata;
+            for (Options option : options)
+                filedata[option] = ChooseCounter(option, *followed.result.file, counter);
+            WriteFileData(followed.result.filename, filedata, patterns, counter.GetSubstringCounts(),
+                          counter.IsUtf8Valid(), counter.GetRanked(settings), counter.GetLengths());
+        }
+        return printed;
+    }
+
+    void ReadEvents()
+    {
+        alignas(inotify_event) char buffer[16 * 1024];
+        ssize_t size = read(notify, buffer, sizeof(buffer));
+        for (ssize_t pos = 0; pos < size; )
+        {
+            const inotify_event* event = reinterpret_cast<const inotify_event*>(buffer + pos);
+            pos += static_cast<ssize_t>(sizeof(inotify_event) + event->len);
+            for (Followed& followed : files)
+            {
+                if (followed.lost || followed.watch != event->wd)
+                    continue;
+                if (event->mask & (IN_MOVE_SELF | IN_DELETE_SELF | IN_IGNORED))
+                {
+                    inotify_rm_watch(notify, followed.watch);
+                    followed.lost = true;
+                }
+                else
+                {
+                    Update(followed);
+                }
+            }
+        }
+    }
+public:
+    Follower(const FileCounter& prototype, const vector<Options>& options, const vector<string>& patterns,
+             const CountSettings& settings)
+        : prototype(prototype), options(options), patterns(patterns), settings(settings),
+          notify(inotify_init1(IN_CLOEXEC))
+    {
+    }
+
+    Follower(const Follower&) = delete;
+    Follower& operator=(const Follower&) = delete;
+
+    ~Follower()
+    {
+        if (notify >= 0)
+            close(notify);
+    }
+
+    void Add(FileResult result)
+    {
+        Followed followed;
+        followed.offset = result.file->Size();
+        followed.watch = inotify_add_watch(notify, result.filename.c_str(), Events);
+        followed.result = move(result);
+        files.push_back(move(followed));
+    }
+
+    // Runs until the process is stopped
+    void Run()
+    {
+        if (notify < 0 || files.empty())
+            return;
+        using Clock = chrono::steady_clock;
+        auto interval = chrono::duration_cast<Clock::duration>(chrono::duration<double>(settings.interval));
+        Clock::time_point nextPrint = Clock::now();
+        while (true)
+        {
+            bool changed = false;
+            bool lost = false;
+            for (const Followed& followed : files)
+            {
+                changed = changed || followed.changed;
+                lost = lost || followed.lost;
+            }
+            // Asleep until a write unless an update is due or a file is missing
+            int timeout = -1;
+            if (changed)
+                timeout = static_cast<int>(max<long long>(0, chrono::duration_cast<chrono::milliseconds>(
+                    nextPrint - Clock::now()).count()));
+            if (lost)
+                timeout = timeout < 0 ? 1000 : min(timeout, 1000);
+            pollfd descriptor { notify, POLLIN, 0 };
+            int ready = poll(&descriptor, 1, timeout);
+            if (ready < 0 && errno != EINTR)
+                return;
+            if (ready > 0)
+                ReadEvents();
+            for (Followed& followed : files)
+            {
+                if (followed.lost)
+                    Reopen(followed);
+            }
+            // A quiet spell does not delay the next update
+            Clock::time_point now = Clock::now();
+            if (now >= nextPrint && Print())
+                nextPrint = now + interval;
+        }
+    }
+};
+#endif
 int main(int argc, char* argv[])
 {
+    FileStats runStats;
     setlocale(LC_ALL, "Russian");
+    InitCharTables();
 
     OptionsParser optionsParser = OptionsParser(argc, argv);
-    for (const string& filename : optionsParser.GetFilenames())
+    CountSettings settings;
+    try
     {
-        ifstream fin(filename);
-        if (fin.fail())
+        settings = ParseSettings(optionsParser.GetSettings());
+        SelectKernels(settings.simd);
+    }
+    catch (InvalidModifier& error)
+    {
+        cout << error.what() << endl;
+        exit(0);
+    }
+
+    vector<string> filenames = optionsParser.GetFilenames();
+    if (filenames.empty())
+        filenames.push_back(StdinName);
+    vector<string> patterns;
+    unique_ptr<FileCounter> prototype;
+    unique_ptr<ResultCache> cache;
+    unique_ptr<CheckpointStore> checkpoints;
+    try
+    {
+        patterns = LoadPatterns(optionsParser.GetModifiers(), optionsParser.GetSettings());
+        settings.topWords = ParseTop(optionsParser.GetModifiers(), Options::FREQ, "--freq", 1000000);
+        settings.topHeavyWords = ParseTop(optionsParser.GetModifiers(), Options::HEAVY_WORDS, "--heavy-hitters", 10000);
+        settings.topHeavyLines = ParseTop(optionsParser.GetModifiers(), Options::HEAVY_LINES, "--heavy-lines", 10000);
+        if (HeavyHitters::Width(settings.heavyMemory, max(settings.topHeavyWords, settings.topHeavyLines)) < 1024)
+            throw InvalidModifier("Value for --heavy-memory is too small for that many heavy hitters");
+        prototype = make_unique<FileCounter>(optionsParser.GetOptions(), patterns, settings);
+        if (!settings.cache.empty())
         {
-            WriteFailFileOpened(filename);
+            cache = make_unique<ResultCache>(settings.cache, settings.cacheSize, optionsParser.GetOptions(),
+                                             patterns, settings.encoding);
+            if (!cache->Usable())
+                cache.reset();
         }
-        else
+        if (!settings.checkpoints.empty())
+            checkpoints = make_unique<CheckpointStore>(settings.checkpoints, *prototype);
+    }
+    catch (InvalidModifier& error)
+    {
+        cout << error.what() << endl;
+        exit(0);
+    }
+
+    // Keeps a few files per worker in flight, so that output can start
+    // before the whole list is counted
+    FileScheduler scheduler(*prototype, optionsParser.GetOptions(), settings, cache.get(), checkpoints.get());
+    size_t window = settings.jobs > 1 ? 4 * static_cast<size_t>(settings.jobs) : 1;
+    InputList inputs(filenames, settings);
+    deque<InputList::Entry> queued;
+    size_t counting = 0;
+    // The exit status, 1 once a file could not be opened or read
+    int status = 0;
+    bool more = true;
+    // One subtotal for each directory whose contents are being printed
+    vector<Subtotal> subtotals;
+    vector<FileResult> followed;
+    while (true)
+    {
+        InputList::Entry entry;
+        while (more && counting < window && (more = inputs.Next(entry)))
         {
-            map<Options, unsigned long long> filedata;
-            for (Options option: optionsParser.GetOptions()) {
-                string modifier = GetModifier(optionsParser.GetModifiers(), option);
-                filedata[option] = ChooseCounter(option, modifier, filename, fin);
+            if (entry.kind == InputList::Kind::FILE)
+            {
+                scheduler.Add(entry.path);
+                counting++;
             }
-
-            WriteFileData(filename, filedata);
+            queued.push_back(move(entry));
+        }
+        if (queued.empty())
+            break;
+        entry = move(queued.front());
+        queued.pop_front();
+        switch (entry.kind)
+        {
+            case InputList::Kind::FILE:
+            {
+                counting--;
+                FileResult result = scheduler.Take();
+                if (!result.opened)
+                {
+                    WriteFailFileOpened(result.filename);
+                    status = 1;
+                    break;
+                }
+                if (result.readError)
+                {
+                    WriteFailFileRead(result.filename, result.readError);
+                    status = 1;
+                    break;
+                }
+                StatsClock::time_point written = result.stats ? StatsClock::now() : StatsClock::time_point();
+                WriteFileData(result.filename, result.filedata, patterns, result.substrings, result.utf8Valid,
+                              result.ranked, result.lengths);
+                if (!result.intact)
+                    cout << "Compressed data is corrupt" << endl;
+                if (result.stats)
+                {
+                    cout.flush();
+                    result.stats->output = NanosecondsSince(written);
+                    WriteStats(result.filename, *result.stats);
+                    AddStats(runStats, *result.stats);
+                }
+                if (!subtotals.empty())
+                    subtotals.back().Add(result.filedata, result.substrings, result.utf8Valid, result.sketches,
+                                         result.hitters, result.lengths);
+                if (result.file)
+                    followed.push_back(move(result));
+                break;
+            }
+            case InputList::Kind::ENTER:
+                subtotals.emplace_back(optionsParser.GetOptions(), patterns.size());
+                break;
+            case InputList::Kind::LEAVE:
+            {
+                Subtotal subtotal = move(subtotals.back());
+                subtotals.pop_back();
+                subtotal.Close(settings);
+                // Exact word lists are not summed across files
+                WriteFileData(entry.path + " (total)", subtotal.filedata, patterns, subtotal.substrings,
+                              subtotal.utf8Valid, subtotal.ranked, subtotal.lengths);
+                if (!subtotals.empty())
+                    subtotals.back().Add(subtotal.filedata, subtotal.substrings, subtotal.utf8Valid, subtotal.sketches,
+                                         subtotal.hitters, subtotal.lengths);
+                break;
+            }
+            case InputList::Kind::UNREADABLE:
+                WriteFailFileOpened(entry.path);
+                status = 1;
+                break;
         }
-        fin.close();
     }
-}
\ No newline at end of file
+    if (settings.stats)
+    {
+        runStats.wall = NanosecondsSince(runStats.started);
+        runStats.hardware = settings.hardwareStats;
+        WriteStats("total", runStats);
+        rusage usage {};
+        getrusage(RUSAGE_SELF, &usage);
+        cerr << "Peak RSS: " << usage.ru_maxrss << " KB" << endl;
+        cerr << "Page faults: " << usage.ru_minflt << " minor, " << usage.ru_majflt << " major" << endl;
+        if (settings.hardwareStats && HwEventsOpened == 0)
+        {
+            int error = HwEventsError;
+            cerr << "Hardware counters are not available: " << strerror(error);
+            if (error == EACCES || error == EPERM)
+                cerr << " (see /proc/sys/kernel/perf_event_paranoid)";
+            else if (error == ENOENT)
+                cerr << " (the CPU or hypervisor exposes no such events)";
+            cerr << endl;
+        }
+    }
+#ifdef WORDCOUNT_INOTIFY
+    if (settings.follow)
+    {
+        Follower follower(*prototype, optionsParser.GetOptions(), patterns, settings);
+        for (FileResult& result : followed)
+            follower.Add(move(result));
+        follower.Run();
+    }
+#endif
+    return status;
+}
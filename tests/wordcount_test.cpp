@@ -0,0 +1,491 @@
+// Consistency checks of the counting engine: every input is counted in one
+// piece and again split into random ranges and blocks, and the counts that
+// have a simple definition are compared with brute force on small inputs.
+// Checks of the kernels run once for every instruction set the CPU
+// supports. Given the name of a check, only that one runs.
+#include "wordcount.h"
+#include "wordcount_engine.h"
+#include <random>
+#include <sstream>
+#include <set>
+
+using namespace std;
+
+static unsigned Failures = 0;
+
+static void Check(bool passed, const string& what)
+{
+    if (passed)
+        return;
+    Failures++;
+    cout << "FAILED: " << what << endl;
+}
+
+// Hands out its input in blocks of random length
+class PieceReader: public InputReader
+{
+private:
+    string_view data;
+    mt19937_64& random;
+    size_t maxBlock;
+public:
+    PieceReader(string_view data, mt19937_64& random, size_t maxBlock)
+        : data(data), random(random), maxBlock(maxBlock)
+    {
+    }
+
+    bool Read(string_view& block) override
+    {
+        if (data.empty())
+            return false;
+        size_t length = min(data.size(), 1 + static_cast<size_t>(random() % maxBlock));
+        block = data.substr(0, length);
+        data.remove_prefix(length);
+        return true;
+    }
+};
+
+// Words, spaces and newlines, with multibyte and invalid UTF-8 among them
+static string RandomText(mt19937_64& random, size_t pieces)
+{
+    static const vector<string> Pieces =
+    {
+        "a", "b", "ab", "aba", " ", " ", "\n", "\n", "\t", "\r\n", "\xD0\xB6", "\xE2\x82\xAC",
+        "\xF0\x9F\x98\x80", "\xFF", "\xD0", "\xC0\xAF", "w1", "w10"
+    };
+    string text;
+    for (size_t index = 0; index < pieces; index++)
+    {
+        // Now and then a word longer than the counters keep of a token
+        if (random() % 500 == 0)
+            text.append(1100 + random() % 200, 'a');
+        else
+            text += Pieces[random() % Pieces.size()];
+    }
+    return text;
+}
+
+static const vector<Options> AllOptions =
+{
+    Options::LINES, Options::WORDS, Options::CHARS, Options::BYTES, Options::SUBSTRING, Options::FREQ,
+    Options::DISTINCT_WORDS, Options::DISTINCT_LINES, Options::HEAVY_WORDS, Options::HEAVY_LINES,
+    Options::MAX_LINE_LENGTH, Options::LINE_HISTOGRAM
+};
+
+// Everything a counter reports, as one comparable string
+static string Summary(const FileCounter& counter, const CountSettings& settings)
+{
+    ostringstream out;
+    for (Options option : AllOptions)
+        out << static_cast<int>(option) << "=" << counter.GetCount(option) << " ";
+    for (unsigned long long count : counter.GetSubstringCounts())
+        out << "s" << count << " ";
+    out << "utf8=" << counter.IsUtf8Valid() << " ";
+    for (const auto& pair_option_items : counter.GetRanked(settings))
+    {
+        for (const auto& pair_item_count : pair_option_items.second.items)
+            out << "[" << pair_item_count.first << "]" << pair_item_count.second << " ";
+    }
+    for (const auto& pair_range_count : counter.GetLengths().Powers())
+        out << pair_range_count.first << ":" << pair_range_count.second << " ";
+    return out.str();
+}
+
+static FileCounter CountWhole(const FileCounter& prototype, const string& text)
+{
+    FileCounter counter = prototype;
+    MappedReader reader(text.data(), text.size(), 1 << 20);
+    counter.Count(reader);
+    return counter;
+}
+
+// Random ranges, each counted from random blocks and merged in order, as
+// -j, checkpoints and --follow do
+static FileCounter CountSplit(const FileCounter& prototype, const string& text, mt19937_64& random)
+{
+    vector<size_t> bounds = { 0, text.size() };
+    size_t cuts = random() % 8;
+    for (size_t cut = 0; cut < cuts && !text.empty(); cut++)
+        bounds.push_back(random() % text.size());
+    sort(bounds.begin(), bounds.end());
+    FileCounter counter = prototype;
+    for (size_t range = 0; range + 1 < bounds.size(); range++)
+    {
+        FileCounter partial = prototype;
+        PieceReader reader(string_view(text).substr(bounds[range], bounds[range + 1] - bounds[range]), random,
+                           1 + random() % 200);
+        partial.Count(reader);
+        counter.Merge(partial);
+    }
+    return counter;
+}
+
+static void CheckSplits(mt19937_64& random, const string& level)
+{
+    CountSettings settings;
+    settings.topWords = 1000;
+    settings.topHeavyWords = 1000;
+    settings.topHeavyLines = 1000;
+    FileCounter prototype(AllOptions, { "a", "ab", "aba", "\xD0\xB6", " \n", "w1" }, settings);
+    for (size_t round = 0; round < 300; round++)
+    {
+        string text = RandomText(random, random() % 2000);
+        string whole = Summary(CountWhole(prototype, text), settings);
+        for (size_t split = 0; split < 4; split++)
+        {
+            string parts = Summary(CountSplit(prototype, text, random), settings);
+            Check(parts == whole, level + ": split counts differ from one-shot counts\n  " + whole + "\n  " + parts);
+        }
+    }
+}
+
+// UTF-8 chars against their definition, over random bytes of every value
+static void CheckChars(mt19937_64& random, const string& level)
+{
+    CountSettings settings;
+    FileCounter prototype({ Options::CHARS }, {}, settings);
+    for (size_t round = 0; round < 300; round++)
+    {
+        string text(random() % 2000, '\0');
+        for (char& sim : text)
+            sim = static_cast<char>(random());
+        unsigned long long expected = 0;
+        for (char sim : text)
+        {
+            unsigned char byte = static_cast<unsigned char>(sim);
+            expected += (byte >= 0x20 && byte < 0x7F) || (byte >= 0xC2 && byte <= 0xF4);
+        }
+        unsigned long long counted = CountSplit(prototype, text, random).GetCount(Options::CHARS);
+        Check(counted == expected, level + ": counted " + to_string(counted) + " chars, expected " + to_string(expected));
+    }
+}
+
+// Occurrences that may overlap, one position at a time
+static unsigned long long BruteForce(const string& text, const string& pattern)
+{
+    unsigned long long count = 0;
+    for (size_t pos = 0; pos + pattern.length() <= text.length(); pos++)
+        count += text.compare(pos, pattern.length(), pattern) == 0;
+    return count;
+}
+
+// One pattern, a few, and more than MatcherList takes before AhoCorasick
+static void CheckSubstrings(mt19937_64& random, const string& level)
+{
+    CountSettings settings;
+    for (size_t round = 0; round < 300; round++)
+    {
+        string text;
+        size_t length = random() % 3000;
+        for (size_t pos = 0; pos < length; pos++)
+            text += "aab \n"[random() % 5];
+        vector<string> patterns;
+        size_t count = 1 + random() % (round % 3 == 0 ? 1 : round % 3 == 1 ? 4 : 12);
+        for (size_t index = 0; index < count; index++)
+        {
+            string pattern;
+            size_t patternLength = 1 + random() % (random() % 4 == 0 ? 40 : 5);
+            for (size_t pos = 0; pos < patternLength; pos++)
+                pattern += "ab "[random() % 3];
+            patterns.push_back(pattern);
+        }
+        FileCounter prototype({ Options::SUBSTRING }, patterns, settings);
+        vector<unsigned long long> split = CountSplit(prototype, text, random).GetSubstringCounts();
+        for (size_t index = 0; index < patterns.size(); index++)
+        {
+            unsigned long long expected = BruteForce(text, patterns[index]);
+            Check(split[index] == expected, level + ": substring \"" + patterns[index] + "\" counted "
+                  + to_string(split[index]) + " times, expected " + to_string(expected));
+        }
+    }
+}
+
+// Every string of up to two bytes, short alphanumeric ones and numbered
+// tokens, none of which may share a whole 64-bit hash
+static void CheckWordHashes()
+{
+    static const string Alphabet = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+    vector<string> words = { "" };
+    for (unsigned first = 0; first < 256; first++)
+    {
+        words.push_back(string(1, static_cast<char>(first)));
+        for (unsigned second = 0; second < 256; second++)
+            words.push_back({ static_cast<char>(first), static_cast<char>(second) });
+    }
+    for (size_t length = 3; length <= 4; length++)
+    {
+        size_t letters = length == 3 ? Alphabet.length() : 36;
+        size_t total = 1;
+        for (size_t pos = 0; pos < length; pos++)
+            total *= letters;
+        for (size_t index = 0; index < total; index++)
+        {
+            string word;
+            for (size_t rest = index, pos = 0; pos < length; pos++, rest /= letters)
+                word += Alphabet[rest % letters];
+            words.push_back(word);
+        }
+    }
+    for (unsigned number = 0; number < 100000; number++)
+        words.push_back("w" + to_string(number));
+    vector<pair<unsigned long long, size_t>> hashes;
+    for (size_t index = 0; index < words.size(); index++)
+        hashes.emplace_back(HashWord(words[index].data(), words[index].length()), index);
+    sort(hashes.begin(), hashes.end());
+    for (size_t index = 1; index < hashes.size(); index++)
+    {
+        // Some words are listed twice, such as "w1" among those of two bytes
+        const string& left = words[hashes[index - 1].second];
+        const string& right = words[hashes[index].second];
+        if (hashes[index].first == hashes[index - 1].first && left != right)
+            Check(false, "\"" + left + "\" and \"" + right + "\" have the same hash");
+    }
+}
+
+// --distinct-words and --distinct-lines against exact counts, within three
+// standard errors of the sketch
+static void CheckDistinct(mt19937_64& random)
+{
+    CountSettings settings;
+    for (unsigned long long distinct : { 1, 100, 1000, 10000, 200000 })
+    {
+        string text;
+        set<string> lines;
+        for (unsigned long long index = 0; index < 2 * distinct; index++)
+        {
+            string word = "w" + to_string(index < distinct ? index : random() % distinct);
+            text += word + (random() % 3 == 0 ? "\n" : " ");
+        }
+        size_t start = 0;
+        for (size_t end; (end = text.find('\n', start)) != string::npos; start = end + 1)
+            lines.insert(text.substr(start, end - start));
+        lines.insert(text.substr(start));
+        FileCounter prototype({ Options::DISTINCT_WORDS, Options::DISTINCT_LINES }, {}, settings);
+        FileCounter counter = CountSplit(prototype, text, random);
+        double error = 3 * 1.04 / sqrt(static_cast<double>(1 << settings.hllPrecision));
+        for (const auto& pair_option_exact : { make_pair(Options::DISTINCT_WORDS, distinct),
+                                                make_pair(Options::DISTINCT_LINES, static_cast<unsigned long long>(lines.size())) })
+        {
+            double exact = static_cast<double>(pair_option_exact.second);
+            double estimate = static_cast<double>(counter.GetCount(pair_option_exact.first));
+            Check(fabs(estimate - exact) <= max(1.0, error * exact), "distinct count " + to_string(estimate)
+                  + ", exact " + to_string(pair_option_exact.second));
+        }
+    }
+    // A sketch saved at one precision is not loaded at another
+    FileCounter saved = CountWhole(FileCounter({ Options::DISTINCT_WORDS }, {}, settings), "a b c");
+    stringstream state;
+    saved.Save(state);
+    CountSettings other = settings;
+    other.hllPrecision = settings.hllPrecision - 4;
+    FileCounter loaded({ Options::DISTINCT_WORDS }, {}, other);
+    Check(loaded.Shape() != saved.Shape(), "sketches of two precisions share a shape");
+    Check(!loaded.Load(state), "distinct words loaded at another precision");
+}
+
+// --heavy-hitters past its exact table: the heaviest words are found, and
+// no count is below the true one or above it by more than the bound
+static void CheckHeavyHitters(mt19937_64& random)
+{
+    CountSettings settings;
+    settings.heavyMemory = 1 << 20;
+    settings.topHeavyWords = 5;
+    map<string, unsigned long long> exact = { { "w1", 5000 }, { "w10", 3000 }, { "w100", 2000 }, { "x", 1500 },
+                                              { "yy", 1200 } };
+    for (unsigned index = 0; index < 200000; index++)
+        exact["u" + to_string(index)] += 1 + random() % 3;
+    vector<string> words;
+    for (const auto& pair_word_count : exact)
+        words.insert(words.end(), pair_word_count.second, pair_word_count.first);
+    shuffle(words.begin(), words.end(), random);
+    string text;
+    for (const string& word : words)
+        text += word + (random() % 10 == 0 ? "\n" : " ");
+    FileCounter prototype({ Options::HEAVY_WORDS }, {}, settings);
+    FileCounter counter = CountSplit(prototype, text, random);
+    RankedItems top = counter.GetRanked(settings)[Options::HEAVY_WORDS];
+    Check(top.error > 0, "heavy hitters did not leave the exact table");
+    vector<string> expected = { "w1", "w10", "w100", "x", "yy" };
+    Check(top.items.size() == expected.size(), "heavy hitters listed " + to_string(top.items.size()) + " words");
+    for (size_t index = 0; index < min(top.items.size(), expected.size()); index++)
+    {
+        const auto& pair_word_count = top.items[index];
+        unsigned long long count = exact[pair_word_count.first];
+        Check(pair_word_count.first == expected[index], "heavy hitter " + to_string(index) + " is \""
+              + pair_word_count.first + "\", expected \"" + expected[index] + "\"");
+        Check(pair_word_count.second >= count && pair_word_count.second <= count + top.error,
+              "heavy hitter \"" + pair_word_count.first + "\" counted " + to_string(pair_word_count.second)
+              + ", exact " + to_string(count) + ", error bound " + to_string(top.error));
+    }
+    // A checkpointed sketch resumes under the same --heavy-memory only
+    stringstream state;
+    counter.Save(state);
+    FileCounter resumed = prototype;
+    Check(resumed.Load(state) && resumed.GetRanked(settings)[Options::HEAVY_WORDS].items == top.items,
+          "heavy hitters changed through a checkpoint");
+    CountSettings other = settings;
+    other.heavyMemory = 512 << 10;
+    FileCounter narrowed({ Options::HEAVY_WORDS }, {}, other);
+    state.clear();
+    state.seekg(0);
+    Check(narrowed.Shape() != prototype.Shape(), "heavy hitters under two memories share a shape");
+    Check(!narrowed.Load(state), "heavy hitters loaded under another --heavy-memory");
+}
+
+// A read that fails is reported by the file rather than taken for its end:
+// a regular file and a pipe are read through descriptors open for writing
+static void CheckReadErrors()
+{
+    char path[] = "/tmp/wordcount_test_XXXXXX";
+    int fd = mkstemp(path);
+    Check(fd >= 0, "can not create a temporary file");
+    if (fd < 0)
+        return;
+    Check(write(fd, "one two\n", 8) == 8, "can not write the temporary file");
+    close(fd);
+    int pipeEnds[2];
+    Check(pipe(pipeEnds) == 0, "can not create a pipe");
+    close(pipeEnds[0]);
+    FileCounter prototype({ Options::LINES }, {}, CountSettings());
+    for (IoMode io : { IoMode::READ, IoMode::AUTO, IoMode::URING })
+    {
+        CountSettings settings;
+        settings.io = io;
+        for (int descriptor : { open(path, O_WRONLY), dup(pipeEnds[1]) })
+        {
+            InputFile file;
+            Check(file.Attach(descriptor, settings), "can not attach a descriptor");
+            FileCounter counter = prototype;
+            counter.Count(*file.Read());
+            Check(file.ReadError() == EBADF, "failed read reported as " + to_string(file.ReadError()));
+        }
+    }
+    close(pipeEnds[1]);
+    fd = open(path, O_WRONLY);
+    try
+    {
+        wordcount::Count(fd);
+        Check(false, "library counted a file it could not read");
+    }
+    catch (system_error& error)
+    {
+        Check(error.code().value() == EBADF, string("library failed with ") + error.what());
+    }
+    close(fd);
+    unlink(path);
+}
+
+static string Describe(const wordcount::Result& result)
+{
+    ostringstream out;
+    out << result.lines << " " << result.words << " " << result.chars << " " << result.bytes << " "
+        << result.maxLineLength << " " << result.utf8Valid << " " << result.intact;
+    for (unsigned long long count : result.substrings)
+        out << " " << count;
+    return out.str();
+}
+
+// The library API gives the counts of the engine for a buffer, for pieces
+// fed to a Counter and for a file descriptor
+static void CheckLibrary(mt19937_64& random)
+{
+    wordcount::Options options;
+    options.chars = true;
+    options.maxLineLength = true;
+    options.substrings = { "a", "aba", "\xD0\xB6" };
+    FileCounter prototype({ Options::LINES, Options::WORDS, Options::CHARS, Options::BYTES,
+                            Options::MAX_LINE_LENGTH, Options::SUBSTRING }, options.substrings, CountSettings());
+    char path[] = "/tmp/wordcount_test_XXXXXX";
+    int fd = mkstemp(path);
+    Check(fd >= 0, "can not create a temporary file");
+    if (fd < 0)
+        return;
+    unlink(path);
+    for (size_t round = 0; round < 50; round++)
+    {
+        string text = RandomText(random, random() % 5000);
+        FileCounter counter = CountWhole(prototype, text);
+        wordcount::Result expected;
+        expected.lines = counter.GetCount(Options::LINES);
+        expected.words = counter.GetCount(Options::WORDS);
+        expected.chars = counter.GetCount(Options::CHARS);
+        expected.bytes = counter.GetCount(Options::BYTES);
+        expected.maxLineLength = counter.GetCount(Options::MAX_LINE_LENGTH);
+        expected.substrings.assign(counter.GetSubstringCounts().begin(), counter.GetSubstringCounts().end());
+        expected.utf8Valid = counter.IsUtf8Valid();
+
+        Check(Describe(wordcount::Count(text.data(), text.size(), options)) == Describe(expected),
+              "library counts of a buffer differ from the engine");
+        wordcount::Counter streaming(options);
+        for (size_t pos = 0; pos < text.size(); )
+        {
+            size_t length = min(text.size() - pos, 1 + static_cast<size_t>(random() % 300));
+            streaming.Feed(text.data() + pos, length);
+            pos += length;
+        }
+        Check(Describe(streaming.Get()) == Describe(expected), "library counts of pieces differ from the engine");
+        Check(ftruncate(fd, 0) == 0 && pwrite(fd, text.data(), text.size(), 0) == static_cast<ssize_t>(text.size()),
+              "can not write the temporary file");
+        Check(Describe(wordcount::Count(fd, options)) == Describe(expected),
+              "library counts of a file differ from the engine");
+    }
+    close(fd);
+}
+
+// Runs a check once for every instruction set the CPU supports
+static void ForEachLevel(void (*check)(mt19937_64&, const string&))
+{
+    static const vector<pair<string, SimdLevel>> Levels =
+    {
+        { "scalar", SimdLevel::SCALAR },
+        { "sse2", SimdLevel::SSE2 },
+        { "avx2", SimdLevel::AVX2 },
+        { "avx512", SimdLevel::AVX512 }
+    };
+    for (const auto& pair_name_level : Levels)
+    {
+        if (!SimdSupported(pair_name_level.second))
+            continue;
+        SelectKernels(pair_name_level.second);
+        mt19937_64 random(1);
+        check(random, pair_name_level.first);
+    }
+    SelectKernels(SimdLevel::AUTO);
+}
+
+// The checks by the name CTest runs each of them under; all of them when
+// no name is given
+static const vector<pair<string, void (*)()>> Checks =
+{
+    { "splits", []() { ForEachLevel(CheckSplits); } },
+    { "substrings", []() { ForEachLevel(CheckSubstrings); } },
+    { "chars", []() { ForEachLevel(CheckChars); } },
+    { "hashes", []() { CheckWordHashes(); } },
+    { "distinct", []() { mt19937_64 random(2); CheckDistinct(random); } },
+    { "heavy", []() { mt19937_64 random(2); CheckHeavyHitters(random); } },
+    { "library", []() { mt19937_64 random(2); CheckLibrary(random); } },
+    { "read_errors", []() { CheckReadErrors(); } }
+};
+
+int main(int argc, char* argv[])
+{
+    setlocale(LC_ALL, "Russian");
+    InitCharTables();
+    SelectKernels(SimdLevel::AUTO);
+    string only = argc > 1 ? argv[1] : "";
+    bool found = false;
+    for (const auto& pair_name_check : Checks)
+    {
+        if (!only.empty() && pair_name_check.first != only)
+            continue;
+        found = true;
+        pair_name_check.second();
+    }
+    if (!found)
+    {
+        cout << "No check is named " << only << endl;
+        return 1;
+    }
+    cout << (Failures ? to_string(Failures) + " checks failed" : "All checks passed") << endl;
+    return Failures ? 1 : 0;
+}
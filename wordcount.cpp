@@ -0,0 +1,158 @@
+// The stable API of wordcount.h on top of the counting engine
+#include "wordcount.h"
+#include "wordcount_engine.h"
+#include <cerrno>
+#include <mutex>
+#include <stdexcept>
+#include <system_error>
+#include <unistd.h>
+
+namespace wordcount
+{
+
+namespace
+{
+
+// What the engine counts, as opposed to wordcount::Options
+using EngineOption = ::Options;
+
+// Char tables follow the locale of the host program when they are first needed
+void Initialize()
+{
+    static std::once_flag done;
+    std::call_once(done, []()
+    {
+        InitCharTables();
+        SelectKernels(SimdLevel::AUTO);
+    });
+}
+
+CountSettings MakeSettings(const Options& options)
+{
+    if (options.bufferSize < 4096 || options.bufferSize > (1ULL << 30))
+        throw std::invalid_argument("Buffer size must be between 4K and 1G");
+    CountSettings settings;
+    settings.bufferSize = options.bufferSize;
+    settings.encoding = options.utf8 ? Encoding::UTF8 : Encoding::CP1251;
+    settings.decompress = options.decompress;
+    return settings;
+}
+
+FileCounter MakeCounter(const Options& options)
+{
+    Initialize();
+    std::vector<EngineOption> selected;
+    if (options.lines)
+        selected.push_back(EngineOption::LINES);
+    if (options.words)
+        selected.push_back(EngineOption::WORDS);
+    if (options.chars)
+        selected.push_back(EngineOption::CHARS);
+    if (options.bytes)
+        selected.push_back(EngineOption::BYTES);
+    if (options.maxLineLength)
+        selected.push_back(EngineOption::MAX_LINE_LENGTH);
+    if (!options.substrings.empty())
+        selected.push_back(EngineOption::SUBSTRING);
+    for (const std::string& pattern : options.substrings)
+    {
+        if (pattern.empty())
+            throw std::invalid_argument("Substring patterns can not be empty");
+    }
+    try
+    {
+        return FileCounter(selected, options.substrings, MakeSettings(options));
+    }
+    catch (InvalidModifier& error)
+    {
+        throw std::invalid_argument(error.what());
+    }
+}
+
+Result MakeResult(const FileCounter& counter, const Options& options, unsigned long long bytes)
+{
+    Result result;
+    if (options.lines)
+        result.lines = counter.GetCount(EngineOption::LINES);
+    if (options.words)
+        result.words = counter.GetCount(EngineOption::WORDS);
+    if (options.chars)
+        result.chars = counter.GetCount(EngineOption::CHARS);
+    if (options.bytes)
+        result.bytes = bytes;
+    if (options.maxLineLength)
+        result.maxLineLength = counter.GetCount(EngineOption::MAX_LINE_LENGTH);
+    if (!options.substrings.empty())
+    {
+        const std::vector<unsigned long long>& counts = counter.GetSubstringCounts();
+        result.substrings.assign(counts.begin(), counts.end());
+    }
+    result.utf8Valid = counter.IsUtf8Valid();
+    return result;
+}
+
+}
+
+Result Count(const void* data, std::size_t size, const Options& options)
+{
+    Counter counter(options);
+    counter.Feed(data, size);
+    return counter.Get();
+}
+
+Result Count(int fd, const Options& options)
+{
+    FileCounter counter = MakeCounter(options);
+    InputFile file;
+    errno = 0;
+    if (!file.Attach(dup(fd), MakeSettings(options)))
+        throw std::system_error(errno ? errno : EISDIR, std::generic_category(), "wordcount::Count");
+    // Like the binary, a regular file that is stored as it is counts its
+    // bytes without being read
+    if (counter.NeedsScan() || !file.IsRegular() || file.IsCompressed())
+        counter.Count(*file.Read());
+    if (file.ReadError())
+        throw std::system_error(file.ReadError(), std::generic_category(), "wordcount::Count");
+    Result result = MakeResult(counter, options, BytesCount(file, counter));
+    result.intact = !file.IsCorrupt();
+    return result;
+}
+
+struct Counter::State
+{
+    Options options;
+    FileCounter prototype;
+    FileCounter counter;
+
+    explicit State(const Options& options)
+        : options(options), prototype(MakeCounter(options)), counter(prototype)
+    {
+    }
+};
+
+Counter::Counter(const Options& options)
+    : state(std::make_unique<State>(options))
+{
+}
+
+Counter::~Counter() = default;
+Counter::Counter(Counter&& other) noexcept = default;
+Counter& Counter::operator=(Counter&& other) noexcept = default;
+
+void Counter::Feed(const void* data, std::size_t size)
+{
+    MappedReader reader(static_cast<const char*>(data), size, state->options.bufferSize);
+    state->counter.Count(reader);
+}
+
+Result Counter::Get() const
+{
+    return MakeResult(state->counter, state->options, state->counter.GetCount(EngineOption::BYTES));
+}
+
+void Counter::Reset()
+{
+    state->counter = state->prototype;
+}
+
+}
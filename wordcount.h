@@ -0,0 +1,91 @@
+// In-process counting with WordCount, for programs that would otherwise
+// run the binary and parse its output. This header is the stable part of
+// libwordcount: it does not include the engine, and its types only grow
+// new fields with defaults.
+//
+//     wordcount::Options options;
+//     options.chars = true;
+//     wordcount::Result result = wordcount::Count(data, size, options);
+//
+// Counts match those the WordCount binary prints for the same input and
+// options. Invalid options throw std::invalid_argument.
+#ifndef WORDCOUNT_H
+#define WORDCOUNT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace wordcount
+{
+
+// What to count; lines, words and bytes by default, like the binary
+struct Options
+{
+    bool lines = true;
+    bool words = true;
+    bool chars = false;
+    bool bytes = true;
+    bool maxLineLength = false;
+    // Occurrences of each pattern, overlapping ones included
+    std::vector<std::string> substrings;
+    // Chars are UTF-8 code points, or printable CP1251 bytes when false
+    bool utf8 = true;
+    // Whether gzip, zstd and xz inputs are counted decompressed; buffers
+    // are always counted as they are
+    bool decompress = true;
+    // Block size the counters work on
+    std::size_t bufferSize = 256 * 1024;
+};
+
+// Counts that were not asked for are zero. Like the binary, lines are the
+// newlines plus one, since the end of the input closes the last line.
+struct Result
+{
+    std::uint64_t lines = 0;
+    std::uint64_t words = 0;
+    std::uint64_t chars = 0;
+    std::uint64_t bytes = 0;
+    std::uint64_t maxLineLength = 0;
+    // One count for each of Options::substrings, in the same order
+    std::vector<std::uint64_t> substrings;
+    // False when chars were counted over invalid UTF-8
+    bool utf8Valid = true;
+    // False when a compressed input turned out broken or truncated
+    bool intact = true;
+};
+
+Result Count(const void* data, std::size_t size, const Options& options = Options());
+
+// A regular file is counted whole whatever its offset, anything else from
+// its current position to its end. The descriptor stays open. Throws
+// std::system_error when it can not be read.
+Result Count(int fd, const Options& options = Options());
+
+// Counts an input that arrives in pieces: feeding the pieces one after
+// another gives the same result as counting them as one buffer.
+class Counter
+{
+public:
+    explicit Counter(const Options& options = Options());
+    ~Counter();
+    Counter(Counter&& other) noexcept;
+    Counter& operator=(Counter&& other) noexcept;
+
+    void Feed(const void* data, std::size_t size);
+
+    // The counts of everything fed so far; feeding may go on afterwards
+    Result Get() const;
+
+    // Starts over with nothing fed
+    void Reset();
+private:
+    struct State;
+    std::unique_ptr<State> state;
+};
+
+}
+
+#endif
@@ -0,0 +1,4643 @@
+// Counting engine of WordCount: the counters, the readers they are fed
+// from and the scheduler that spreads files and ranges over threads. The
+// command line lives in main.cpp. Programs that embed the counting should
+// use the stable API of wordcount.h; this header may change with them.
+#ifndef WORDCOUNT_ENGINE_H
+#define WORDCOUNT_ENGINE_H
+
+#include <iostream>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <fstream>
+#include <algorithm>
+#include <numeric>
+#include <memory>
+#include <string_view>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <deque>
+#include <ctime>
+#include <chrono>
+#include <cmath>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define WORDCOUNT_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+
+#if defined(__linux__) && __has_include(<linux/perf_event.h>)
+#define WORDCOUNT_PERF
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+// Decompressors are linked when the build finds them
+#ifdef WORDCOUNT_ZLIB
+#include <zlib.h>
+#endif
+#ifdef WORDCOUNT_LZMA
+#include <lzma.h>
+#endif
+#ifdef WORDCOUNT_ZSTD
+#include <zstd.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#define WORDCOUNT_X86
+#include <immintrin.h>
+#endif
+
+enum class Options
+{
+    LINES,
+    WORDS,
+    SUBSTRING,
+    CHARS,
+    BYTES,
+    FREQ,
+    DISTINCT_WORDS,
+    DISTINCT_LINES,
+    HEAVY_WORDS,
+    HEAVY_LINES,
+    MAX_LINE_LENGTH,
+    LINE_HISTOGRAM,
+    // Printed with -c for compressed inputs, not an option of its own
+    COMPRESSED_BYTES
+};
+
+enum class Settings
+{
+    BUFFER_SIZE,
+    IO,
+    SIMD,
+    JOBS,
+    SUBSTRINGS_FROM,
+    ENCODING,
+    QUEUE_DEPTH,
+    RECURSIVE,
+    INCLUDE,
+    EXCLUDE,
+    CACHE,
+    CACHE_SIZE,
+    CHECKPOINTS,
+    FOLLOW,
+    INTERVAL,
+    HLL_PRECISION,
+    HEAVY_MEMORY,
+    DECOMPRESS,
+    STATS
+};
+
+enum class Encoding
+{
+    UTF8,
+    CP1251
+};
+
+enum class SimdLevel
+{
+    AUTO,
+    SCALAR,
+    SSE2,
+    AVX2,
+    AVX512
+};
+
+enum class IoMode
+{
+    AUTO,
+    READ,
+    MMAP,
+    URING
+};
+
+class InvalidModifier: public std::exception
+{
+private:
+    std::string message_error;
+public:
+    explicit InvalidModifier(const std::string& message_error)
+        : message_error(message_error)
+    {
+    }
+    const std::string& what()
+    {
+        return message_error;
+    }
+};
+
+struct CountSettings
+{
+    size_t bufferSize = 256 * 1024;
+    IoMode io = IoMode::AUTO;
+    SimdLevel simd = SimdLevel::AUTO;
+    unsigned jobs = 1;
+    Encoding encoding = Encoding::UTF8;
+    // Reads in flight per file with --io=uring
+    unsigned queueDepth = 32;
+    bool recursive = false;
+    // Globs for the names of files found by -r
+    std::vector<std::string> include;
+    std::vector<std::string> exclude;
+    // Result cache file, none when empty, and its size budget
+    std::string cache;
+    unsigned long long cacheSize = 16 << 20;
+    // Directory of per-file checkpoints for files that only grow
+    std::string checkpoints;
+    bool follow = false;
+    // Seconds between updates with --follow, 0 for every change
+    double interval = 0;
+    // Words listed by --freq
+    size_t topWords = 10;
+    // Log2 of the register count of --distinct-* sketches
+    unsigned hllPrecision = 14;
+    // Items listed by --heavy-hitters and by --heavy-lines
+    size_t topHeavyWords = 10;
+    size_t topHeavyLines = 10;
+    // Cap on the memory of each heavy hitters sketch
+    size_t heavyMemory = 8 << 20;
+    // Whether gzip, zstd and xz inputs are counted decompressed
+    bool decompress = true;
+    // Timings and I/O counts of every file on stderr
+    bool stats = false;
+    // With stats, hardware counters of every counter pass as well
+    bool hardwareStats = false;
+};
+
+// A count of bytes or items with an optional K, M or G suffix
+inline unsigned long long ParseSize(const std::string& value, const std::string& name)
+{
+    size_t pos = 0;
+    unsigned long long size = 0;
+    try
+    {
+        size = std::stoull(value, &pos);
+    }
+    catch (std::logic_error&)
+    {
+        throw InvalidModifier("Invalid value for " + name + ": " + value);
+    }
+    std::string suffix = value.substr(pos);
+    if (suffix == "K" || suffix == "k")
+        size <<= 10;
+    else if (suffix == "M" || suffix == "m")
+        size <<= 20;
+    else if (suffix == "G" || suffix == "g")
+        size <<= 30;
+    else if (!suffix.empty())
+        throw InvalidModifier("Invalid value for " + name + ": " + value);
+    return size;
+}
+
+// Lengths of lines for -L and --line-length-histogram in log-linear
+// buckets: lengths below 8 exactly and eight buckets for every power of
+// two above, so that a percentile is off by less than 1/8.
+class LengthHistogram
+{
+private:
+    static constexpr unsigned SubBits = 3;
+    static constexpr size_t Buckets = (64 - SubBits + 1) << SubBits;
+
+    unsigned long long buckets[Buckets] = {};
+    unsigned long long count = 0;
+    unsigned long long maximum = 0;
+
+    static size_t Bucket(unsigned long long length)
+    {
+        if (length < (1u << SubBits))
+            return static_cast<size_t>(length);
+        unsigned log = 63 - static_cast<unsigned>(__builtin_clzll(length));
+        return ((log - SubBits + 1) << SubBits) + static_cast<size_t>((length >> (log - SubBits)) & ((1u << SubBits) - 1));
+    }
+
+    static unsigned long long Lower(size_t bucket)
+    {
+        if (bucket < (1u << SubBits))
+            return bucket;
+        unsigned log = static_cast<unsigned>(bucket >> SubBits) + SubBits - 1;
+        return 1ULL << log | static_cast<unsigned long long>(bucket & ((1u << SubBits) - 1)) << (log - SubBits);
+    }
+
+    static unsigned long long Upper(size_t bucket)
+    {
+        return bucket + 1 == Buckets ? ~0ULL : Lower(bucket + 1) - 1;
+    }
+public:
+    void Add(unsigned long long length)
+    {
+        buckets[Bucket(length)]++;
+        count++;
+        maximum = std::max(maximum, length);
+    }
+
+    void Merge(const LengthHistogram& other)
+    {
+        for (size_t bucket = 0; bucket < Buckets; bucket++)
+            buckets[bucket] += other.buckets[bucket];
+        count += other.count;
+        maximum = std::max(maximum, other.maximum);
+    }
+
+    unsigned long long Max() const
+    {
+        return maximum;
+    }
+
+    // The upper end of the bucket that holds the line at that fraction
+    unsigned long long Percentile(double fraction) const
+    {
+        unsigned long long rank = std::max<unsigned long long>(1, static_cast<unsigned long long>(ceil(fraction * static_cast<double>(count))));
+        unsigned long long seen = 0;
+        for (size_t bucket = 0; bucket < Buckets; bucket++)
+        {
+            seen += buckets[bucket];
+            if (seen >= rank)
+                return std::min(Upper(bucket), maximum);
+        }
+        return maximum;
+    }
+
+    // Counts by power of two: 0, 1, 2-3, 4-7 and so on
+    std::vector<std::pair<std::string, unsigned long long>> Powers() const
+    {
+        std::vector<std::pair<std::string, unsigned long long>> result;
+        for (size_t bucket = 0; bucket < Buckets; bucket++)
+        {
+            if (buckets[bucket] == 0)
+                continue;
+            unsigned long long lower = Lower(bucket);
+            unsigned long long first = lower < 2 ? lower : 1ULL << (63 - __builtin_clzll(lower));
+            unsigned long long last = lower < 2 ? lower : first * 2 - 1;
+            std::string range = first == last ? std::to_string(first) : std::to_string(first) + "-" + std::to_string(last);
+            if (!result.empty() && result.back().first == range)
+                result.back().second += buckets[bucket];
+            else
+                result.emplace_back(range, buckets[bucket]);
+        }
+        return result;
+    }
+
+    void Save(std::ostream& out) const
+    {
+        out.write(reinterpret_cast<const char*>(buckets), sizeof(buckets));
+        unsigned long long fields[] = { count, maximum };
+        out.write(reinterpret_cast<const char*>(fields), sizeof(fields));
+    }
+
+    bool Load(std::istream& in)
+    {
+        unsigned long long fields[2];
+        if (!in.read(reinterpret_cast<char*>(buckets), sizeof(buckets)) || !in.read(reinterpret_cast<char*>(fields), sizeof(fields)))
+            return false;
+        count = fields[0];
+        maximum = fields[1];
+        return true;
+    }
+};
+
+// The items listed by --freq and --heavy-*, with the most a count may
+// exceed the true one by
+struct RankedItems
+{
+    std::vector<std::pair<std::string, unsigned long long>> items;
+    unsigned long long error = 0;
+};
+
+// The passes of FileCounter::Feed, timed one by one with --stats
+enum class Kernel
+{
+    WORD_TOKENS,
+    LINE_TOKENS,
+    LINE_LENGTHS,
+    LINES,
+    WORDS,
+    CHARS,
+    SUBSTRINGS
+};
+
+inline constexpr size_t KernelCount = 7;
+
+// Hardware events counted around each pass with --stats=hw
+enum class HwEvent
+{
+    CYCLES,
+    INSTRUCTIONS,
+    BRANCH_MISSES,
+    CACHE_MISSES,
+    LLC_LOADS
+};
+
+inline constexpr size_t HwEventCount = 5;
+
+using StatsClock = std::chrono::steady_clock;
+
+inline unsigned long long NanosecondsSince(StatsClock::time_point start)
+{
+    return static_cast<unsigned long long>(std::chrono::duration_cast<std::chrono::nanoseconds>(StatsClock::now() - start).count());
+}
+
+// Where the time of one file went, gathered only with --stats. Times are
+// in nanoseconds; ranges counted in parallel add up theirs, so the parts
+// can exceed the wall time.
+struct FileStats
+{
+    StatsClock::time_point started = StatsClock::now();
+    std::atomic<unsigned long long> wall { 0 };
+    std::atomic<unsigned long long> open { 0 };
+    // In InputReader::Read, waiting for the disk, a pipe or a decompressor
+    std::atomic<unsigned long long> wait { 0 };
+    std::atomic<unsigned long long> kernels[KernelCount] = {};
+    // With --stats=hw, the events of each pass
+    bool hardware = false;
+    std::atomic<unsigned long long> events[KernelCount][HwEventCount] = {};
+    std::atomic<unsigned long long> output { 0 };
+    // read(2), pread(2) and io_uring_enter(2) calls for the contents
+    std::atomic<unsigned long long> syscalls { 0 };
+    // Blocks handed to the counters
+    std::atomic<unsigned long long> refills { 0 };
+    std::atomic<unsigned long long> bytes { 0 };
+};
+
+// Events that could be counted on some thread, by bit, and the error of
+// the first one that could not
+inline std::atomic<unsigned> HwEventsOpened { 0 };
+inline std::atomic<int> HwEventsError { 0 };
+
+// Hardware counters of the calling thread, opened as one perf event group
+// so that all of them cover the same instructions. Events the CPU or the
+// kernel does not offer are left out, and without any of them Read fails;
+// perf_event_paranoid above 2, containers and most VMs allow none.
+class PerfCounters
+{
+private:
+    std::vector<int> fds;
+    // Event of each value of a group read
+    std::vector<size_t> order;
+public:
+    PerfCounters()
+    {
+#ifdef WORDCOUNT_PERF
+        static const std::pair<unsigned, unsigned long long> Events[HwEventCount] =
+        {
+            { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+            { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+            { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+            { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+            { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | PERF_COUNT_HW_CACHE_OP_READ << 8
+                                  | PERF_COUNT_HW_CACHE_RESULT_ACCESS << 16 }
+        };
+        for (size_t event = 0; event < HwEventCount; event++)
+        {
+            perf_event_attr attr {};
+            attr.size = sizeof(attr);
+            attr.type = Events[event].first;
+            attr.config = Events[event].second;
+            attr.read_format = PERF_FORMAT_GROUP;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            int leader = fds.empty() ? -1 : fds[0];
+            int fd = static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, leader, PERF_FLAG_FD_CLOEXEC));
+            if (fd < 0)
+            {
+                int none = 0;
+                HwEventsError.compare_exchange_strong(none, errno);
+                continue;
+            }
+            fds.push_back(fd);
+            order.push_back(event);
+            HwEventsOpened |= 1u << event;
+        }
+#else
+        HwEventsError = ENOSYS;
+#endif
+    }
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    ~PerfCounters()
+    {
+        for (int fd : fds)
+            close(fd);
+    }
+
+    // Current values by event, zero for those that are not counted
+    bool Read(unsigned long long (&values)[HwEventCount]) const
+    {
+        if (fds.empty())
+            return false;
+        unsigned long long group[1 + HwEventCount];
+        ssize_t size = read(fds[0], group, sizeof(group));
+        if (size < static_cast<ssize_t>(sizeof(unsigned long long)) || group[0] != order.size())
+            return false;
+        std::fill(std::begin(values), std::end(values), 0);
+        for (size_t index = 0; index < order.size(); index++)
+            values[order[index]] = group[1 + index];
+        return true;
+    }
+};
+
+// One set of counters for each thread that counts, opened on first use
+inline const PerfCounters& ThreadPerfCounters()
+{
+    static thread_local PerfCounters counters;
+    return counters;
+}
+
+// Input is handed to the counters as a sequence of blocks, so a counter
+// loops over a whole span instead of paying a streambuf call per byte.
+class InputReader
+{
+public:
+    virtual ~InputReader() = default;
+
+    // Returns false when the input is exhausted
+    virtual bool Read(std::string_view& block) = 0;
+};
+
+// Keeps the errno of the first read of an input that failed, since the
+// readers of its ranges can only tell their counters that they are done
+inline void ReadFailed(std::atomic<int>* error, int code)
+{
+    int none = 0;
+    if (error)
+        error->compare_exchange_strong(none, code);
+}
+
+// Reads a byte range of a regular file with pread(2), or a pipe or device
+// from its current position with read(2), into an aligned buffer.
+class BlockReader: public InputReader
+{
+private:
+    static constexpr size_t Alignment = 4096;
+
+    int fd;
+    size_t bufferSize;
+    std::unique_ptr<char, decltype(&free)> buffer;
+    bool positional;
+    unsigned long long offset;
+    unsigned long long end;
+    std::atomic<unsigned long long>* syscalls;
+    std::atomic<int>* error;
+public:
+    BlockReader(int fd, size_t bufferSize, std::atomic<unsigned long long>* syscalls = nullptr,
+                std::atomic<int>* error = nullptr)
+        : BlockReader(fd, bufferSize, 0, 0, syscalls, error)
+    {
+        positional = false;
+    }
+
+    BlockReader(int fd, size_t bufferSize, unsigned long long begin, unsigned long long end,
+                std::atomic<unsigned long long>* syscalls = nullptr, std::atomic<int>* error = nullptr)
+        : fd(fd),
+          bufferSize((bufferSize + Alignment - 1) / Alignment * Alignment),
+          buffer(static_cast<char*>(aligned_alloc(Alignment, this->bufferSize)), &free),
+          positional(true), offset(begin), end(end), syscalls(syscalls), error(error)
+    {
+        if (!buffer)
+            throw std::bad_alloc();
+    }
+
+    bool Read(std::string_view& block) override
+    {
+        size_t length = bufferSize;
+        if (positional)
+        {
+            if (offset >= end)
+                return false;
+            length = static_cast<size_t>(std::min<unsigned long long>(length, end - offset));
+        }
+        ssize_t size;
+        do
+        {
+            if (positional)
+                size = pread(fd, buffer.get(), length, static_cast<off_t>(offset));
+            else
+                size = read(fd, buffer.get(), length);
+            if (syscalls)
+                syscalls->fetch_add(1, std::memory_order_relaxed);
+        } while (size < 0 && errno == EINTR);
+        if (size < 0)
+            ReadFailed(error, errno);
+        if (size <= 0)
+            return false;
+        offset += static_cast<unsigned long long>(size);
+        block = std::string_view(buffer.get(), static_cast<size_t>(size));
+        return true;
+    }
+};
+
+// Where a PipelinedReader gets its bytes from
+class ByteSource
+{
+public:
+    virtual ~ByteSource() = default;
+
+    // Fills as much of the buffer as it can, setting end when nothing follows
+    virtual size_t Fill(char* buffer, size_t size, bool& end) = 0;
+};
+
+// A pipe, terminal or device, after the bytes already taken from it to
+// tell its format
+class DescriptorSource: public ByteSource
+{
+private:
+    int fd;
+    std::string prefix;
+    std::atomic<unsigned long long>* syscalls;
+    std::atomic<int>* error;
+public:
+    DescriptorSource(int fd, std::string prefix, std::atomic<unsigned long long>* syscalls = nullptr,
+                     std::atomic<int>* error = nullptr)
+        : fd(fd), prefix(std::move(prefix)), syscalls(syscalls), error(error)
+    {
+    }
+
+    // Reads until the buffer is full or the input ends, so that a pipe
+    // handing out small chunks still gives the counters long blocks
+    size_t Fill(char* buffer, size_t size, bool& end) override
+    {
+        size_t filled = std::min(size, prefix.length());
+        memcpy(buffer, prefix.data(), filled);
+        prefix.erase(0, filled);
+        while (filled < size)
+        {
+            ssize_t got = read(fd, buffer + filled, size - filled);
+            if (syscalls)
+                syscalls->fetch_add(1, std::memory_order_relaxed);
+            if (got < 0 && errno == EINTR)
+                continue;
+            if (got < 0)
+                ReadFailed(error, errno);
+            if (got <= 0)
+            {
+                end = true;
+                break;
+            }
+            filled += static_cast<size_t>(got);
+        }
+        return filled;
+    }
+};
+
+// Streams a source that can be read only once: a filler thread fills a
+// ring of buffers while the caller counts the previous ones, so waiting on
+// a pipe writer or a decompressor overlaps with counting. A block handed
+// out by Read() stays valid until the next call.
+class PipelinedReader: public InputReader
+{
+private:
+    static constexpr size_t Alignment = 4096;
+    static constexpr size_t RingSize = 4;
+
+    std::unique_ptr<ByteSource> source;
+    size_t bufferSize;
+    std::vector<std::unique_ptr<char, decltype(&free)>> ring;
+    size_t sizes[RingSize] = {};
+    // Buffers in [first, first + filled) hold data the caller has not taken
+    size_t first = 0;
+    size_t filled = 0;
+    bool holding = false;
+    bool finished = false;
+    bool stopping = false;
+    std::mutex lock;
+    std::condition_variable changed;
+    std::thread filler;
+
+    void Run()
+    {
+        for (size_t next = 0; ; next = (next + 1) % RingSize)
+        {
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                changed.wait(guard, [this]() { return stopping || filled < RingSize; });
+                if (stopping)
+                    return;
+            }
+            // The buffer is free until it is published below
+            bool end = false;
+            size_t size = source->Fill(ring[next].get(), bufferSize, end);
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                sizes[next] = size;
+                if (size > 0)
+                    filled++;
+                finished = end;
+            }
+            changed.notify_all();
+            if (end)
+                return;
+        }
+    }
+public:
+    PipelinedReader(std::unique_ptr<ByteSource> source, size_t bufferSize)
+        : source(std::move(source)), bufferSize((bufferSize + Alignment - 1) / Alignment * Alignment)
+    {
+        for (size_t index = 0; index < RingSize; index++)
+        {
+            ring.emplace_back(static_cast<char*>(aligned_alloc(Alignment, this->bufferSize)), &free);
+            if (!ring.back())
+                throw std::bad_alloc();
+        }
+        filler = std::thread(&PipelinedReader::Run, this);
+    }
+
+    ~PipelinedReader() override
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        changed.notify_all();
+        filler.join();
+    }
+
+    bool Read(std::string_view& block) override
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        if (holding)
+        {
+            // The block handed out last time goes back to the filler
+            first = (first + 1) % RingSize;
+            filled--;
+            holding = false;
+            changed.notify_all();
+        }
+        changed.wait(guard, [this]() { return filled > 0 || finished; });
+        if (filled == 0)
+            return false;
+        holding = true;
+        block = std::string_view(ring[first].get(), sizes[first]);
+        return true;
+    }
+};
+
+// Zero-copy input for regular files: the counters read straight from the
+// page cache through a private read-only mapping, one block at a time so
+// that all fused counters work on the same cache-resident span.
+class MappedReader: public InputReader
+{
+private:
+    const char* data;
+    size_t size;
+    size_t blockSize;
+    size_t offset = 0;
+public:
+    MappedReader(const char* data, size_t size, size_t blockSize)
+        : data(data), size(size), blockSize(blockSize)
+    {
+    }
+
+    bool Read(std::string_view& block) override
+    {
+        if (offset == size)
+            return false;
+        size_t length = std::min(blockSize, size - offset);
+        block = std::string_view(data + offset, length);
+        offset += length;
+        return true;
+    }
+};
+
+#ifdef WORDCOUNT_URING
+// Reads a byte range of a regular file through io_uring, keeping up to
+// queue depth reads of one buffer each in flight while the counters work
+// on the oldest one, so that storage sees a deep queue even though blocks
+// are still handed out in file order. The ring is driven with the raw
+// system calls, which keeps the static build free of liburing.
+class UringReader: public InputReader
+{
+private:
+    static constexpr size_t Alignment = 4096;
+
+    struct Request
+    {
+        std::unique_ptr<char, decltype(&free)> buffer { nullptr, &free };
+        iovec target {};
+        unsigned long long offset = 0;
+        // Zero once the range has no more reads for this request
+        size_t length = 0;
+        long long result = 0;
+        bool done = false;
+    };
+
+    int fd;
+    size_t bufferSize;
+    unsigned long long next;
+    unsigned long long end;
+    std::atomic<unsigned long long>* syscalls;
+    std::atomic<int>* error;
+    std::vector<Request> requests;
+    size_t current = 0;
+    bool holding = false;
+    unsigned inflight = 0;
+    unsigned unsubmitted = 0;
+
+    int ring = -1;
+    io_uring_params params {};
+    void* sqMap = MAP_FAILED;
+    size_t sqMapSize = 0;
+    void* cqMap = MAP_FAILED;
+    size_t cqMapSize = 0;
+    io_uring_sqe* sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+    size_t sqesSize = 0;
+    unsigned* sqTail = nullptr;
+    unsigned* sqMask = nullptr;
+    unsigned* sqArray = nullptr;
+    unsigned* cqHead = nullptr;
+    unsigned* cqTail = nullptr;
+    unsigned* cqMask = nullptr;
+    io_uring_cqe* cqes = nullptr;
+
+    template <typename T>
+    static T* At(void* map, unsigned offset)
+    {
+        return reinterpret_cast<T*>(static_cast<char*>(map) + offset);
+    }
+
+    void Queue(size_t index, unsigned long long offset)
+    {
+        Request& request = requests[index];
+        request.offset = offset;
+        request.length = static_cast<size_t>(std::min<unsigned long long>(bufferSize, end - offset));
+        request.done = false;
+        request.target.iov_base = request.buffer.get();
+        request.target.iov_len = request.length;
+
+        unsigned tail = *sqTail;
+        unsigned slot = tail & *sqMask;
+        io_uring_sqe& sqe = sqes[slot];
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_READV;
+        sqe.fd = fd;
+        sqe.addr = reinterpret_cast<unsigned long long>(&request.target);
+        sqe.len = 1;
+        sqe.off = offset;
+        sqe.user_data = index;
+        sqArray[slot] = slot;
+        __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+        unsubmitted++;
+        inflight++;
+        next = offset + request.length;
+    }
+
+    // Submits the queued reads and, if asked, waits for one to complete
+    bool Enter(unsigned waitFor)
+    {
+        while (unsubmitted > 0 || waitFor > 0)
+        {
+            long submitted = syscall(__NR_io_uring_enter, ring, unsubmitted, waitFor,
+                                     waitFor > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+            if (syscalls)
+                syscalls->fetch_add(1, std::memory_order_relaxed);
+            if (submitted < 0)
+            {
+                if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+                    continue;
+                return false;
+            }
+            unsubmitted -= static_cast<unsigned>(submitted);
+            if (waitFor > 0 || unsubmitted == 0)
+                break;
+        }
+        return true;
+    }
+
+    void Reap()
+    {
+        unsigned head = *cqHead;
+        unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++)
+        {
+            const io_uring_cqe& cqe = cqes[head & *cqMask];
+            Request& request = requests[static_cast<size_t>(cqe.user_data)];
+            request.result = cqe.res;
+            request.done = true;
+            inflight--;
+        }
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+    }
+
+    // A ring that stops working leaves the rest of the range unread, which
+    // is an error of the file rather than its end
+    bool Failed()
+    {
+        ReadFailed(error, errno);
+        return false;
+    }
+
+    // Finishes a read the ring cut short or failed with pread(2), which
+    // reports the error of the file if it fails as well
+    long long Complete(Request& request)
+    {
+        size_t size = request.result > 0 ? static_cast<size_t>(request.result) : 0;
+        while (size < request.length)
+        {
+            ssize_t got = pread(fd, request.buffer.get() + size, request.length - size,
+                                static_cast<off_t>(request.offset + size));
+            if (syscalls)
+                syscalls->fetch_add(1, std::memory_order_relaxed);
+            if (got < 0 && errno == EINTR)
+                continue;
+            if (got < 0)
+                ReadFailed(error, errno);
+            if (got <= 0)
+                break;
+            size += static_cast<size_t>(got);
+        }
+        return static_cast<long long>(size);
+    }
+public:
+    UringReader(int fd, size_t bufferSize, unsigned queueDepth, unsigned long long begin, unsigned long long end,
+                std::atomic<unsigned long long>* syscalls = nullptr, std::atomic<int>* error = nullptr)
+        : fd(fd), bufferSize((bufferSize + Alignment - 1) / Alignment * Alignment), next(begin), end(end),
+          syscalls(syscalls), error(error)
+    {
+        unsigned long long blocks = (end - begin + this->bufferSize - 1) / this->bufferSize;
+        requests.resize(static_cast<size_t>(std::max(1ULL, std::min<unsigned long long>(queueDepth, blocks))));
+    }
+
+    UringReader(const UringReader&) = delete;
+    UringReader& operator=(const UringReader&) = delete;
+
+    ~UringReader() override
+    {
+        // The kernel may still write into the buffers until every read completes
+        if (ring >= 0)
+        {
+            while (inflight > 0 && Enter(1))
+                Reap();
+        }
+        if (sqes != MAP_FAILED)
+            munmap(sqes, sqesSize);
+        if (cqMap != MAP_FAILED && cqMap != sqMap)
+            munmap(cqMap, cqMapSize);
+        if (sqMap != MAP_FAILED)
+            munmap(sqMap, sqMapSize);
+        if (ring >= 0)
+            close(ring);
+    }
+
+    // Sets up the ring and queues the first reads; false when io_uring can
+    // not be used here, with errno from the failed call
+    bool Start()
+    {
+        for (Request& request : requests)
+        {
+            request.buffer.reset(static_cast<char*>(aligned_alloc(Alignment, bufferSize)));
+            if (!request.buffer)
+                throw std::bad_alloc();
+        }
+        ring = static_cast<int>(syscall(__NR_io_uring_setup, static_cast<unsigned>(requests.size()), &params));
+        if (ring < 0)
+            return false;
+        sqMapSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqMapSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single)
+            sqMapSize = cqMapSize = std::max(sqMapSize, cqMapSize);
+        sqMap = mmap(nullptr, sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+        if (sqMap == MAP_FAILED)
+            return false;
+        cqMap = single ? sqMap
+                       : mmap(nullptr, cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_CQ_RING);
+        if (cqMap == MAP_FAILED)
+            return false;
+        sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = static_cast<io_uring_sqe*>(mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                               ring, IORING_OFF_SQES));
+        if (sqes == MAP_FAILED)
+            return false;
+        sqTail = At<unsigned>(sqMap, params.sq_off.tail);
+        sqMask = At<unsigned>(sqMap, params.sq_off.ring_mask);
+        sqArray = At<unsigned>(sqMap, params.sq_off.array);
+        cqHead = At<unsigned>(cqMap, params.cq_off.head);
+        cqTail = At<unsigned>(cqMap, params.cq_off.tail);
+        cqMask = At<unsigned>(cqMap, params.cq_off.ring_mask);
+        cqes = At<io_uring_cqe>(cqMap, params.cq_off.cqes);
+
+        for (size_t index = 0; index < requests.size() && next < end; index++)
+            Queue(index, next);
+        return Enter(0);
+    }
+
+    bool Read(std::string_view& block) override
+    {
+        if (holding)
+        {
+            // The buffer handed out last time takes the next read
+            holding = false;
+            if (next < end)
+            {
+                Queue(current, next);
+                if (!Enter(0))
+                    return Failed();
+            }
+            else
+            {
+                requests[current].length = 0;
+            }
+            current = (current + 1) % requests.size();
+        }
+        Request& request = requests[current];
+        if (request.length == 0)
+            return false;
+        while (true)
+        {
+            Reap();
+            if (request.done)
+                break;
+            if (!Enter(1))
+                return Failed();
+        }
+        long long size = Complete(request);
+        if (size <= 0)
+            return false;
+        holding = true;
+        block = std::string_view(request.buffer.get(), static_cast<size_t>(size));
+        return true;
+    }
+};
+
+// Set once io_uring_setup(2) turns out to be missing or forbidden, so that
+// later files go straight to pread(2)
+inline std::atomic<bool> UringUnavailable { false };
+#endif
+
+// Formats that inputs are decompressed from, told by their first bytes
+enum class Compression
+{
+    NONE,
+    GZIP,
+    ZSTD,
+    XZ
+};
+
+struct CompressionMagic
+{
+    Compression compression;
+    const char* bytes;
+    size_t length;
+};
+
+// Only the formats this build can decompress
+inline const std::vector<CompressionMagic> CompressionMagics =
+{
+#ifdef WORDCOUNT_ZLIB
+    { Compression::GZIP, "\x1F\x8B", 2 },
+#endif
+#ifdef WORDCOUNT_ZSTD
+    { Compression::ZSTD, "\x28\xB5\x2F\xFD", 4 },
+#endif
+#ifdef WORDCOUNT_LZMA
+    { Compression::XZ, "\xFD" "7zXZ\0", 6 },
+#endif
+};
+
+// Sets more when the bytes so far may still turn out to start a format
+inline Compression DetectCompression(const char* head, size_t length, bool& more)
+{
+    more = false;
+    for (const CompressionMagic& magic : CompressionMagics)
+    {
+        if (memcmp(head, magic.bytes, std::min(length, magic.length)) != 0)
+            continue;
+        if (length >= magic.length)
+            return magic.compression;
+        more = true;
+    }
+    return Compression::NONE;
+}
+
+// What decompression of an input found out, shared by the decoders of
+// all of its ranges
+struct DecodeStats
+{
+    std::atomic<unsigned long long> compressed { 0 };
+    std::atomic<bool> corrupt { false };
+};
+
+// Decompresses the blocks of a reader over compressed bytes, one frame or
+// member after another. What precedes broken data is still handed out.
+class DecodingSource: public ByteSource
+{
+private:
+    std::unique_ptr<InputReader> input;
+    DecodeStats& stats;
+    std::string_view pending;
+protected:
+    bool exhausted = false;
+
+    // Takes up to limit more compressed bytes
+    bool NextInput(std::string_view& block, size_t limit)
+    {
+        if (pending.empty())
+        {
+            if (!input->Read(pending))
+            {
+                exhausted = true;
+                return false;
+            }
+            stats.compressed += pending.size();
+        }
+        block = pending.substr(0, limit);
+        pending.remove_prefix(block.size());
+        return true;
+    }
+
+    void Corrupt()
+    {
+        stats.corrupt = true;
+    }
+public:
+    DecodingSource(std::unique_ptr<InputReader> input, DecodeStats& stats)
+        : input(std::move(input)), stats(stats)
+    {
+    }
+};
+
+#ifdef WORDCOUNT_ZLIB
+// Concatenated gzip members, BGZF blocks included. Bytes after the last
+// member that do not start another one are ignored, as gzip(1) does.
+class GzipSource: public DecodingSource
+{
+private:
+    z_stream stream {};
+    unsigned long long members = 0;
+    bool done = false;
+public:
+    GzipSource(std::unique_ptr<InputReader> input, DecodeStats& stats)
+        : DecodingSource(std::move(input), stats)
+    {
+        if (inflateInit2(&stream, 15 + 16) != Z_OK)
+            throw std::bad_alloc();
+    }
+
+    ~GzipSource() override
+    {
+        inflateEnd(&stream);
+    }
+
+    size_t Fill(char* buffer, size_t size, bool& end) override
+    {
+        stream.next_out = reinterpret_cast<Bytef*>(buffer);
+        stream.avail_out = static_cast<uInt>(std::min<size_t>(size, 1U << 30));
+        while (!done && stream.avail_out > 0)
+        {
+            if (stream.avail_in == 0)
+            {
+                std::string_view block;
+                if (!NextInput(block, 1U << 30))
+                {
+                    // A member cut short
+                    if (stream.total_in > 0)
+                        Corrupt();
+                    done = true;
+                    break;
+                }
+                stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(block.data()));
+                stream.avail_in = static_cast<uInt>(block.size());
+            }
+            int status = inflate(&stream, Z_NO_FLUSH);
+            if (status == Z_STREAM_END)
+            {
+                members++;
+                inflateReset(&stream);
+                continue;
+            }
+            if (status == Z_OK || status == Z_BUF_ERROR)
+                continue;
+            if (members == 0 || stream.total_out > 0)
+                Corrupt();
+            done = true;
+        }
+        end = done;
+        return size - stream.avail_out;
+    }
+};
+#endif
+
+#ifdef WORDCOUNT_LZMA
+// Concatenated xz streams
+class XzSource: public DecodingSource
+{
+private:
+    lzma_stream stream = LZMA_STREAM_INIT;
+    bool done = false;
+public:
+    XzSource(std::unique_ptr<InputReader> input, DecodeStats& stats)
+        : DecodingSource(std::move(input), stats)
+    {
+        if (lzma_stream_decoder(&stream, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK)
+            throw std::bad_alloc();
+    }
+
+    ~XzSource() override
+    {
+        lzma_end(&stream);
+    }
+
+    size_t Fill(char* buffer, size_t size, bool& end) override
+    {
+        stream.next_out = reinterpret_cast<uint8_t*>(buffer);
+        stream.avail_out = size;
+        while (!done && stream.avail_out > 0)
+        {
+            std::string_view block;
+            if (stream.avail_in == 0 && !exhausted && NextInput(block, block.max_size()))
+            {
+                stream.next_in = reinterpret_cast<const uint8_t*>(block.data());
+                stream.avail_in = block.size();
+            }
+            lzma_ret status = lzma_code(&stream, exhausted ? LZMA_FINISH : LZMA_RUN);
+            if (status == LZMA_OK)
+                continue;
+            if (status != LZMA_STREAM_END)
+                Corrupt();
+            done = true;
+        }
+        end = done;
+        return size - stream.avail_out;
+    }
+};
+#endif
+
+#ifdef WORDCOUNT_ZSTD
+// Concatenated zstd frames, skippable ones included
+class ZstdSource: public DecodingSource
+{
+private:
+    ZSTD_DStream* stream;
+    ZSTD_inBuffer in {};
+    // Zero between frames
+    size_t hint = 0;
+    bool done = false;
+public:
+    ZstdSource(std::unique_ptr<InputReader> input, DecodeStats& stats)
+        : DecodingSource(std::move(input), stats), stream(ZSTD_createDStream())
+    {
+        if (!stream)
+            throw std::bad_alloc();
+    }
+
+    ~ZstdSource() override
+    {
+        ZSTD_freeDStream(stream);
+    }
+
+    size_t Fill(char* buffer, size_t size, bool& end) override
+    {
+        ZSTD_outBuffer out { buffer, size, 0 };
+        while (!done && out.pos < out.size)
+        {
+            if (in.pos == in.size)
+            {
+                std::string_view block;
+                if (!NextInput(block, block.max_size()))
+                {
+                    if (hint != 0)
+                        Corrupt();
+                    done = true;
+                    break;
+                }
+                in = { block.data(), block.size(), 0 };
+            }
+            hint = ZSTD_decompressStream(stream, &out, &in);
+            if (ZSTD_isError(hint))
+            {
+                Corrupt();
+                done = true;
+            }
+        }
+        end = done;
+        return out.pos;
+    }
+};
+#endif
+
+// Null for a format the build has no decompressor for, which leaves the
+// input and stats unused
+inline std::unique_ptr<ByteSource> MakeDecoder(Compression compression, [[maybe_unused]] std::unique_ptr<InputReader> input,
+                                               [[maybe_unused]] DecodeStats& stats)
+{
+    switch (compression)
+    {
+#ifdef WORDCOUNT_ZLIB
+        case Compression::GZIP:
+            return std::make_unique<GzipSource>(std::move(input), stats);
+#endif
+#ifdef WORDCOUNT_LZMA
+        case Compression::XZ:
+            return std::make_unique<XzSource>(std::move(input), stats);
+#endif
+#ifdef WORDCOUNT_ZSTD
+        case Compression::ZSTD:
+            return std::make_unique<ZstdSource>(std::move(input), stats);
+#endif
+        default:
+            return nullptr;
+    }
+}
+
+// The filename that stands for standard input, which is also counted when
+// no filenames are given
+inline const std::string StdinName = "-";
+
+// An opened input. Regular files can hand out readers for any byte range,
+// so that parts of one file can be counted independently.
+class InputFile
+{
+private:
+    int fd = -1;
+    struct stat info {};
+    char* mapping = nullptr;
+    size_t mappingSize = 0;
+    size_t bufferSize = 0;
+    IoMode io = IoMode::AUTO;
+    unsigned queueDepth = 1;
+    Compression compression = Compression::NONE;
+    // Bytes of a stream read to tell its format
+    std::string peeked;
+    mutable DecodeStats decoded;
+    // Errno of the first read of the contents that failed
+    mutable std::atomic<int> readError { 0 };
+    FileStats* stats = nullptr;
+
+    std::atomic<unsigned long long>* Syscalls() const
+    {
+        return stats ? &stats->syscalls : nullptr;
+    }
+
+    void Detect()
+    {
+        char head[8];
+        size_t length = 0;
+        bool more = true;
+        if (IsRegular())
+        {
+            ssize_t got = pread(fd, head, sizeof(head), 0);
+            length = got > 0 ? static_cast<size_t>(got) : 0;
+            compression = DetectCompression(head, length, more);
+            return;
+        }
+        // A stream is read only as far as a format may still match
+        while (more && length < sizeof(head))
+        {
+            ssize_t got = read(fd, head + length, sizeof(head) - length);
+            if (got < 0 && errno == EINTR)
+                continue;
+            if (got <= 0)
+                break;
+            length += static_cast<size_t>(got);
+            compression = DetectCompression(head, length, more);
+        }
+        peeked.assign(head, length);
+    }
+
+    // Reads compressed bytes as they are stored
+    std::unique_ptr<InputReader> ReadStored(unsigned long long begin, unsigned long long end) const
+    {
+        if (mapping && end <= mappingSize)
+            return std::make_unique<MappedReader>(mapping + begin, static_cast<size_t>(end - begin), bufferSize);
+#ifdef WORDCOUNT_URING
+        if (io == IoMode::URING && !UringUnavailable)
+        {
+            auto reader = std::make_unique<UringReader>(fd, bufferSize, queueDepth, begin, end, Syscalls(), &readError);
+            if (reader->Start())
+                return reader;
+            if (errno == ENOSYS || errno == EPERM)
+                UringUnavailable = true;
+        }
+#endif
+        return std::make_unique<BlockReader>(fd, bufferSize, begin, end, Syscalls(), &readError);
+    }
+
+    // Offsets of the BGZF blocks that make up the whole file, each of them
+    // a gzip member that records its own size
+    std::vector<unsigned long long> GzipBlocks() const
+    {
+        std::vector<unsigned long long> blocks;
+        unsigned long long offset = 0;
+        while (offset < Size())
+        {
+            unsigned char header[18];
+            if (pread(fd, header, sizeof(header), static_cast<off_t>(offset)) != static_cast<ssize_t>(sizeof(header)))
+                return {};
+            bool bgzf = header[0] == 0x1F && header[1] == 0x8B && header[2] == 8 && (header[3] & 4)
+                && (header[10] | header[11] << 8) >= 6 && header[12] == 'B' && header[13] == 'C'
+                && (header[14] | header[15] << 8) == 2;
+            if (!bgzf)
+                return {};
+            blocks.push_back(offset);
+            offset += static_cast<unsigned long long>(header[16] | header[17] << 8) + 1;
+        }
+        return offset == Size() ? blocks : std::vector<unsigned long long>();
+    }
+public:
+    InputFile() = default;
+    InputFile(const InputFile&) = delete;
+    InputFile& operator=(const InputFile&) = delete;
+
+    ~InputFile()
+    {
+        if (mapping)
+            munmap(mapping, mappingSize);
+        if (fd >= 0)
+            close(fd);
+    }
+
+    // Reads of the contents are counted into stats when it is given
+    bool Open(const std::string& filename, const CountSettings& settings, FileStats* fileStats = nullptr)
+    {
+        return Attach(filename == StdinName ? dup(STDIN_FILENO) : open(filename.c_str(), O_RDONLY), settings,
+                      fileStats);
+    }
+
+    // Takes over an open descriptor, which is closed with the file
+    bool Attach(int descriptor, const CountSettings& settings, FileStats* fileStats = nullptr)
+    {
+        stats = fileStats;
+        fd = descriptor;
+        if (fd < 0)
+            return false;
+        if (fstat(fd, &info) != 0 || S_ISDIR(info.st_mode))
+            return false;
+        bufferSize = settings.bufferSize;
+        io = settings.io;
+        queueDepth = settings.queueDepth;
+        // Pipes, devices and empty files can not be mapped and are read instead
+        if ((io == IoMode::AUTO || io == IoMode::MMAP) && IsRegular() && info.st_size > 0)
+        {
+            void* data = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED)
+            {
+                mapping = static_cast<char*>(data);
+                mappingSize = static_cast<size_t>(info.st_size);
+#ifdef MADV_SEQUENTIAL
+                madvise(mapping, mappingSize, MADV_SEQUENTIAL);
+#endif
+#ifdef MADV_HUGEPAGE
+                madvise(mapping, mappingSize, MADV_HUGEPAGE);
+#endif
+            }
+        }
+        if (settings.decompress && !CompressionMagics.empty())
+            Detect();
+        return true;
+    }
+
+    bool IsCompressed() const
+    {
+        return compression != Compression::NONE;
+    }
+
+    unsigned long long CompressedSize() const
+    {
+        return IsRegular() ? Size() : decoded.compressed.load();
+    }
+
+    // Whether decompression ran into broken or truncated data
+    bool IsCorrupt() const
+    {
+        return decoded.corrupt;
+    }
+
+    // Errno of a read that failed, after which the contents were cut
+    // short, 0 when every read succeeded
+    int ReadError() const
+    {
+        return readError;
+    }
+
+    // Offsets at which a compressed file can be decompressed independently,
+    // empty when it has to be read from the start: BGZF blocks, or zstd
+    // frames while the file is mapped
+    std::vector<unsigned long long> Frames() const
+    {
+        if (compression == Compression::GZIP)
+            return GzipBlocks();
+#ifdef WORDCOUNT_ZSTD
+        if (compression == Compression::ZSTD && mapping && mappingSize == Size())
+        {
+            std::vector<unsigned long long> frames;
+            size_t offset = 0;
+            while (offset < mappingSize)
+            {
+                size_t length = ZSTD_findFrameCompressedSize(mapping + offset, mappingSize - offset);
+                if (ZSTD_isError(length))
+                    return {};
+                frames.push_back(offset);
+                offset += length;
+            }
+            return frames;
+        }
+#endif
+        return {};
+    }
+
+    bool IsRegular() const
+    {
+        return S_ISREG(info.st_mode);
+    }
+
+    const struct stat& Info() const
+    {
+        return info;
+    }
+
+    // Stats the file again, for callers that need to know it did not
+    // change while it was read
+    bool Restat(struct stat& current) const
+    {
+        return fstat(fd, &current) == 0;
+    }
+
+    // Takes the current size of a file that is being written to; bytes
+    // past the original mapping are read with pread(2)
+    bool Refresh()
+    {
+        return fstat(fd, &info) == 0;
+    }
+
+    unsigned long long Size() const
+    {
+        return static_cast<unsigned long long>(info.st_size);
+    }
+
+    // A compressed stream is read on one thread and decompressed on
+    // another, both ahead of the counters
+    std::unique_ptr<InputReader> Read() const
+    {
+        if (!IsRegular())
+        {
+            auto stream = std::make_unique<PipelinedReader>(std::make_unique<DescriptorSource>(fd, peeked, Syscalls(), &readError), bufferSize);
+            if (!IsCompressed())
+                return stream;
+            return std::make_unique<PipelinedReader>(MakeDecoder(compression, std::move(stream), decoded), bufferSize);
+        }
+        return Read(0, Size());
+    }
+
+    // Of a compressed file, the decompressed contents of the frames stored
+    // in that range
+    std::unique_ptr<InputReader> Read(unsigned long long begin, unsigned long long end) const
+    {
+        if (IsCompressed())
+            return std::make_unique<PipelinedReader>(MakeDecoder(compression, ReadStored(begin, end), decoded), bufferSize);
+        return ReadStored(begin, end);
+    }
+};
+
+// Character classes of the current locale, filled once after setlocale()
+inline bool SpaceTable[256];
+// Printable characters of CP1251: ASCII without controls and every upper
+// half code except the unassigned 0x98
+inline bool PrintTable[256];
+
+// The space class split by nibbles for the pshufb kernels: a byte is a
+// space when SpaceLow[low nibble] & SpaceHigh[high nibble] != 0. Every
+// distinct set of low nibbles among the high-nibble rows takes one bit,
+// so any class with at most eight distinct rows can be looked up this way.
+inline unsigned char SpaceLow[16];
+inline unsigned char SpaceHigh[16];
+inline bool SpaceByNibbles = false;
+inline bool SpaceIsAscii = false;
+
+inline void InitCharTables()
+{
+    for (int sim = 0; sim < 256; sim++)
+    {
+        SpaceTable[sim] = isspace(sim) != 0;
+        PrintTable[sim] = (sim >= 0x20 && sim < 0x7F) || (sim >= 0x80 && sim != 0x98);
+    }
+
+    SpaceIsAscii = true;
+    for (int sim = 0; sim < 256; sim++)
+    {
+        bool ascii = sim == ' ' || (sim >= '\t' && sim <= '\r');
+        if (SpaceTable[sim] != ascii)
+            SpaceIsAscii = false;
+    }
+
+    std::vector<unsigned> rows;
+    memset(SpaceLow, 0, sizeof(SpaceLow));
+    memset(SpaceHigh, 0, sizeof(SpaceHigh));
+    SpaceByNibbles = true;
+    for (int high = 0; high < 16; high++)
+    {
+        unsigned row = 0;
+        for (int low = 0; low < 16; low++)
+        {
+            if (SpaceTable[high << 4 | low])
+                row |= 1u << low;
+        }
+        if (row == 0)
+            continue;
+        size_t bit = std::find(rows.begin(), rows.end(), row) - rows.begin();
+        if (bit == rows.size())
+        {
+            if (rows.size() == 8)
+            {
+                SpaceByNibbles = false;
+                return;
+            }
+            rows.push_back(row);
+        }
+        SpaceHigh[high] |= static_cast<unsigned char>(1u << bit);
+        for (int low = 0; low < 16; low++)
+        {
+            if (row & (1u << low))
+                SpaceLow[low] |= static_cast<unsigned char>(1u << bit);
+        }
+    }
+}
+
+inline size_t CountByteScalar(const char* data, size_t size, char byte)
+{
+    size_t count = 0;
+    for (size_t pos = 0; pos < size; pos++)
+        count += data[pos] == byte;
+    return count;
+}
+
+#ifdef WORDCOUNT_X86
+// The SSE2 and AVX2 kernels subtract the all-ones compare result from
+// per-lane byte counters and fold them with psadbw every 255 vectors,
+// before a lane can overflow.
+__attribute__((target("sse2")))
+inline size_t CountByteSse2(const char* data, size_t size, char byte)
+{
+    const __m128i needle = _mm_set1_epi8(byte);
+    size_t count = 0;
+    size_t pos = 0;
+    while (size - pos >= 16)
+    {
+        __m128i lanes = _mm_setzero_si128();
+        size_t end = pos + std::min<size_t>((size - pos) / 16, 255) * 16;
+        for (; pos < end; pos += 16)
+        {
+            __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + pos));
+            lanes = _mm_sub_epi8(lanes, _mm_cmpeq_epi8(chunk, needle));
+        }
+        __m128i sums = _mm_sad_epu8(lanes, _mm_setzero_si128());
+        count += static_cast<size_t>(_mm_cvtsi128_si32(sums) + _mm_extract_epi16(sums, 4));
+    }
+    return count + CountByteScalar(data + pos, size - pos, byte);
+}
+
+__attribute__((target("avx2")))
+inline size_t CountByteAvx2(const char* data, size_t size, char byte)
+{
+    const __m256i needle = _mm256_set1_epi8(byte);
+    size_t count = 0;
+    size_t pos = 0;
+    while (size - pos >= 32)
+    {
+        __m256i lanes = _mm256_setzero_si256();
+        size_t end = pos + std::min<size_t>((size - pos) / 32, 255) * 32;
+        for (; pos < end; pos += 32)
+        {
+            __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + pos));
+            lanes = _mm256_sub_epi8(lanes, _mm256_cmpeq_epi8(chunk, needle));
+        }
+        __m256i sums = _mm256_sad_epu8(lanes, _mm256_setzero_si256());
+        __m128i halves = _mm_add_epi64(_mm256_castsi256_si128(sums), _mm256_extracti128_si256(sums, 1));
+        count += static_cast<size_t>(_mm_cvtsi128_si32(halves) + _mm_extract_epi16(halves, 4));
+    }
+    return count + CountByteScalar(data + pos, size - pos, byte);
+}
+
+__attribute__((target("avx512bw,popcnt")))
+inline size_t CountByteAvx512(const char* data, size_t size, char byte)
+{
+    const __m512i needle = _mm512_set1_epi8(byte);
+    size_t count = 0;
+    size_t pos = 0;
+    for (; size - pos >= 64; pos += 64)
+    {
+        __m512i chunk = _mm512_loadu_si512(data + pos);
+        count += _mm_popcnt_u64(_mm512_cmpeq_epi8_mask(chunk, needle));
+    }
+    if (pos < size)
+    {
+        __mmask64 tail = (1ULL << (size - pos)) - 1;
+        __m512i chunk = _mm512_maskz_loadu_epi8(tail, data + pos);
+        count += _mm_popcnt_u64(_mm512_mask_cmpeq_epi8_mask(tail, chunk, needle));
+    }
+    return count;
+}
+#endif
+
+// Bit i is set when byte i of up to 64 equals byte
+inline unsigned long long ByteMaskScalar(const char* data, size_t size, char byte)
+{
+    unsigned long long mask = 0;
+    for (size_t pos = 0; pos < size; pos++)
+        mask |= static_cast<unsigned long long>(data[pos] == byte) << pos;
+    return mask;
+}
+
+inline unsigned long long ByteMask64Scalar(const char* data, char byte)
+{
+    return ByteMaskScalar(data, 64, byte);
+}
+
+#ifdef WORDCOUNT_X86
+__attribute__((target("sse2")))
+inline unsigned long long ByteMask64Sse2(const char* data, char byte)
+{
+    const __m128i needle = _mm_set1_epi8(byte);
+    unsigned long long mask = 0;
+    for (size_t pos = 0; pos < 64; pos += 16)
+    {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + pos));
+        mask |= static_cast<unsigned long long>(static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle)))) << pos;
+    }
+    return mask;
+}
+
+__attribute__((target("avx2")))
+inline unsigned long long ByteMask64Avx2(const char* data, char byte)
+{
+    const __m256i needle = _mm256_set1_epi8(byte);
+    __m256i low = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data));
+    __m256i high = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + 32));
+    return static_cast<unsigned long long>(static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(low, needle))))
+        | static_cast<unsigned long long>(static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(high, needle)))) << 32;
+}
+
+__attribute__((target("avx512bw")))
+inline unsigned long long ByteMask64Avx512(const char* data, char byte)
+{
+    return _mm512_cmpeq_epi8_mask(_mm512_loadu_si512(data), _mm512_set1_epi8(byte));
+}
+#endif
+
+// Word kernels count word starts: non-space bytes that follow a space or
+// the start of input. inWord carries the class of the last byte from one
+// block to the next.
+inline size_t CountWordStartsScalar(const char* data, size_t size, bool& inWord)
+{
+    size_t count = 0;
+    bool previous = inWord;
+    for (size_t pos = 0; pos < size; pos++)
+    {
+        bool word = !SpaceTable[static_cast<unsigned char>(data[pos])];
+        count += word && !previous;
+        previous = word;
+    }
+    inWord = previous;
+    return count;
+}
+
+// Bit i is set when byte i of up to 64 is not a space
+inline unsigned long long WordMaskScalar(const char* data, size_t size)
+{
+    unsigned long long mask = 0;
+    for (size_t pos = 0; pos < size; pos++)
+        mask |= static_cast<unsigned long long>(!SpaceTable[static_cast<unsigned char>(data[pos])]) << pos;
+    return mask;
+}
+
+inline unsigned long long WordMask64Scalar(const char* data)
+{
+    return WordMaskScalar(data, 64);
+}
+
+#ifdef WORDCOUNT_X86
+// Only used when the space class is the ASCII one: ' ' and '\t'..'\r'
+__attribute__((target("sse2")))
+inline unsigned WordMaskSse2(const char* data)
+{
+    __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+    __m128i control = _mm_sub_epi8(chunk, _mm_set1_epi8('\t'));
+    __m128i isControl = _mm_cmpeq_epi8(_mm_min_epu8(control, _mm_set1_epi8('\r' - '\t')), control);
+    __m128i isSpace = _mm_or_si128(isControl, _mm_cmpeq_epi8(chunk, _mm_set1_epi8(' ')));
+    return ~static_cast<unsigned>(_mm_movemask_epi8(isSpace)) & 0xFFFF;
+}
+
+__attribute__((target("sse2")))
+inline size_t CountWordStartsSse2(const char* data, size_t size, bool& inWord)
+{
+    size_t count = 0;
+    size_t pos = 0;
+    unsigned long long carry = inWord;
+    for (; size - pos >= 64; pos += 64)
+    {
+        unsigned long long word = static_cast<unsigned long long>(WordMaskSse2(data + pos))
+            | static_cast<unsigned long long>(WordMaskSse2(data + pos + 16)) << 16
+            | static_cast<unsigned long long>(WordMaskSse2(data + pos + 32)) << 32
+            | static_cast<unsigned long long>(WordMaskSse2(data + pos + 48)) << 48;
+        count += __builtin_popcountll(word & ~(word << 1 | carry));
+        carry = word >> 63;
+    }
+    inWord = carry != 0;
+    return count + CountWordStartsScalar(data + pos, size - pos, inWord);
+}
+
+__attribute__((target("avx2")))
+inline unsigned WordMaskAvx2(const char* data, __m256i low, __m256i high)
+{
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data));
+    __m256i classes = _mm256_and_si256(
+        _mm256_shuffle_epi8(low, _mm256_and_si256(chunk, nibble)),
+        _mm256_shuffle_epi8(high, _mm256_and_si256(_mm256_srli_epi16(chunk, 4), nibble)));
+    return static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(classes, _mm256_setzero_si256())));
+}
+
+__attribute__((target("sse2")))
+inline unsigned long long WordMask64Sse2(const char* data)
+{
+    return static_cast<unsigned long long>(WordMaskSse2(data))
+        | static_cast<unsigned long long>(WordMaskSse2(data + 16)) << 16
+        | static_cast<unsigned long long>(WordMaskSse2(data + 32)) << 32
+        | static_cast<unsigned long long>(WordMaskSse2(data + 48)) << 48;
+}
+
+__attribute__((target("avx2")))
+inline unsigned long long WordMask64Avx2(const char* data)
+{
+    const __m256i low = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(SpaceLow)));
+    const __m256i high = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(SpaceHigh)));
+    return static_cast<unsigned long long>(WordMaskAvx2(data, low, high))
+        | static_cast<unsigned long long>(WordMaskAvx2(data + 32, low, high)) << 32;
+}
+
+__attribute__((target("avx2,popcnt")))
+inline size_t CountWordStartsAvx2(const char* data, size_t size, bool& inWord)
+{
+    const __m256i low = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(SpaceLow)));
+    const __m256i high = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(SpaceHigh)));
+    size_t count = 0;
+    size_t pos = 0;
+    unsigned long long carry = inWord;
+    for (; size - pos >= 64; pos += 64)
+    {
+        unsigned long long word = static_cast<unsigned long long>(WordMaskAvx2(data + pos, low, high))
+            | static_cast<unsigned long long>(WordMaskAvx2(data + pos + 32, low, high)) << 32;
+        count += _mm_popcnt_u64(word & ~(word << 1 | carry));
+        carry = word >> 63;
+    }
+    inWord = carry != 0;
+    return count + CountWordStartsScalar(data + pos, size - pos, inWord);
+}
+
+__attribute__((target("avx512bw,popcnt")))
+inline size_t CountWordStartsAvx512(const char* data, size_t size, bool& inWord)
+{
+    // The zero-masked broadcast, since GCC's plain one merges into an
+    // undefined vector and warns about it under -Wall
+    const __m512i low = _mm512_maskz_broadcast_i32x4(0xFFFF, _mm_loadu_si128(reinterpret_cast<const __m128i*>(SpaceLow)));
+    const __m512i high = _mm512_maskz_broadcast_i32x4(0xFFFF, _mm_loadu_si128(reinterpret_cast<const __m128i*>(SpaceHigh)));
+    const __m512i nibble = _mm512_set1_epi8(0x0F);
+    size_t count = 0;
+    size_t pos = 0;
+    unsigned long long carry = inWord;
+    for (; size - pos >= 64; pos += 64)
+    {
+        __m512i chunk = _mm512_loadu_si512(data + pos);
+        __m512i classes = _mm512_and_si512(
+            _mm512_shuffle_epi8(low, _mm512_and_si512(chunk, nibble)),
+            _mm512_shuffle_epi8(high, _mm512_and_si512(_mm512_srli_epi16(chunk, 4), nibble)));
+        unsigned long long word = _mm512_testn_epi8_mask(classes, classes);
+        count += _mm_popcnt_u64(word & ~(word << 1 | carry));
+        carry = word >> 63;
+    }
+    inWord = carry != 0;
+    return count + CountWordStartsScalar(data + pos, size - pos, inWord);
+}
+#endif
+
+// Substring kernels count every start position where the first and the
+// last byte of the pattern match and compare the middle only there. They
+// expect patterns of at least two bytes.
+inline size_t CountSubstringScalar(const char* data, size_t size, const char* pattern, size_t length)
+{
+    if (size < length)
+        return 0;
+    size_t count = 0;
+    const char* end = data + size - length + 1;
+    const char* pos = data;
+    while ((pos = static_cast<const char*>(memchr(pos, pattern[0], static_cast<size_t>(end - pos)))) != nullptr)
+    {
+        if (pos[length - 1] == pattern[length - 1] && memcmp(pos + 1, pattern + 1, length - 2) == 0)
+            count++;
+        if (++pos == end)
+            break;
+    }
+    return count;
+}
+
+#ifdef WORDCOUNT_X86
+inline size_t CountCandidates(unsigned long long mask, const char* data, const char* pattern, size_t length)
+{
+    size_t count = 0;
+    while (mask)
+    {
+        size_t bit = static_cast<size_t>(__builtin_ctzll(mask));
+        if (memcmp(data + bit + 1, pattern + 1, length - 2) == 0)
+            count++;
+        mask &= mask - 1;
+    }
+    return count;
+}
+
+__attribute__((target("sse2")))
+inline size_t CountSubstringSse2(const char* data, size_t size, const char* pattern, size_t length)
+{
+    if (size < length)
+        return 0;
+    const __m128i first = _mm_set1_epi8(pattern[0]);
+    const __m128i last = _mm_set1_epi8(pattern[length - 1]);
+    size_t starts = size - length + 1;
+    size_t count = 0;
+    size_t pos = 0;
+    for (; starts - pos >= 16; pos += 16)
+    {
+        __m128i head = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + pos));
+        __m128i tail = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + pos + length - 1));
+        unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(head, first), _mm_cmpeq_epi8(tail, last))));
+        count += CountCandidates(mask, data + pos, pattern, length);
+    }
+    return count + CountSubstringScalar(data + pos, size - pos, pattern, length);
+}
+
+__attribute__((target("avx2")))
+inline size_t CountSubstringAvx2(const char* data, size_t size, const char* pattern, size_t length)
+{
+    if (size < length)
+        return 0;
+    const __m256i first = _mm256_set1_epi8(pattern[0]);
+    const __m256i last = _mm256_set1_epi8(pattern[length - 1]);
+    size_t starts = size - length + 1;
+    size_t count = 0;
+    size_t pos = 0;
+    for (; starts - pos >= 32; pos += 32)
+    {
+        __m256i head = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + pos));
+        __m256i tail = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + pos + length - 1));
+        unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(head, first), _mm256_cmpeq_epi8(tail, last))));
+        count += CountCandidates(mask, data + pos, pattern, length);
+    }
+    return count + CountSubstringScalar(data + pos, size - pos, pattern, length);
+}
+
+__attribute__((target("avx512bw")))
+inline size_t CountSubstringAvx512(const char* data, size_t size, const char* pattern, size_t length)
+{
+    if (size < length)
+        return 0;
+    const __m512i first = _mm512_set1_epi8(pattern[0]);
+    const __m512i last = _mm512_set1_epi8(pattern[length - 1]);
+    size_t starts = size - length + 1;
+    size_t count = 0;
+    size_t pos = 0;
+    for (; starts - pos >= 64; pos += 64)
+    {
+        __m512i head = _mm512_loadu_si512(data + pos);
+        __m512i tail = _mm512_loadu_si512(data + pos + length - 1);
+        unsigned long long mask = _mm512_cmpeq_epi8_mask(head, first) & _mm512_cmpeq_epi8_mask(tail, last);
+        count += CountCandidates(mask, data + pos, pattern, length);
+    }
+    return count + CountSubstringScalar(data + pos, size - pos, pattern, length);
+}
+#endif
+
+// UTF-8 character kernels count printable ASCII, which is isprint() in the
+// C locale, and every byte that can lead a valid sequence, 0xC2 to 0xF4.
+// Continuations, C0 controls, DEL and bytes that never lead (0xC0, 0xC1,
+// 0xF5 and up) are not counted. Telling C1 controls or unassigned code
+// points apart would take the bytes after the lead, so they count.
+inline bool CountsAsChar(unsigned char sim)
+{
+    return (sim >= 0x20 && sim < 0x7F) || (sim >= 0xC2 && sim <= 0xF4);
+}
+
+inline size_t CountUtf8Scalar(const char* data, size_t size)
+{
+    size_t count = 0;
+    for (size_t pos = 0; pos < size; pos++)
+        count += CountsAsChar(static_cast<unsigned char>(data[pos]));
+    return count;
+}
+
+// UTF-8 validation follows the lookup algorithm of Keiser and Lemire
+// (simdjson, simdutf). An error at a byte is a function of that byte and
+// the three before it: three nibble lookups flag bad two-byte pairs, and
+// a byte two or three places after a three- or four-byte lead must be a
+// continuation.
+inline constexpr unsigned char Utf8TooShort = 1 << 0;
+inline constexpr unsigned char Utf8TooLong = 1 << 1;
+inline constexpr unsigned char Utf8Overlong3 = 1 << 2;
+inline constexpr unsigned char Utf8TooLarge = 1 << 3;
+inline constexpr unsigned char Utf8Surrogate = 1 << 4;
+inline constexpr unsigned char Utf8Overlong2 = 1 << 5;
+inline constexpr unsigned char Utf8TooLarge1000 = 1 << 6;
+inline constexpr unsigned char Utf8Overlong4 = 1 << 6;
+inline constexpr unsigned char Utf8TwoConts = 1 << 7;
+inline constexpr unsigned char Utf8Carry = Utf8TooShort | Utf8TooLong | Utf8TwoConts;
+
+inline constexpr unsigned char Utf8FirstHigh[16] =
+{
+    Utf8TooLong, Utf8TooLong, Utf8TooLong, Utf8TooLong,
+    Utf8TooLong, Utf8TooLong, Utf8TooLong, Utf8TooLong,
+    Utf8TwoConts, Utf8TwoConts, Utf8TwoConts, Utf8TwoConts,
+    Utf8TooShort | Utf8Overlong2,
+    Utf8TooShort,
+    Utf8TooShort | Utf8Overlong3 | Utf8Surrogate,
+    Utf8TooShort | Utf8TooLarge | Utf8TooLarge1000 | Utf8Overlong4
+};
+
+inline constexpr unsigned char Utf8FirstLow[16] =
+{
+    Utf8Carry | Utf8Overlong3 | Utf8Overlong2 | Utf8Overlong4,
+    Utf8Carry | Utf8Overlong2,
+    Utf8Carry,
+    Utf8Carry,
+    Utf8Carry | Utf8TooLarge,
+    Utf8Carry | Utf8TooLarge | Utf8TooLarge1000,
+    Utf8Carry | Utf8TooLarge | Utf8TooLarge1000,
+    Utf8Carry | Utf8TooLarge | Utf8TooLarge1000,
+    Utf8Carry | Utf8TooLarge | Utf8TooLarge1000,
+    Utf8Carry | Utf8TooLarge | Utf8TooLarge1000,
+    Utf8Carry | Utf8TooLarge | Utf8TooLarge1000,
+    Utf8Carry | Utf8TooLarge | Utf8TooLarge1000,
+    Utf8Carry | Utf8TooLarge | Utf8TooLarge1000,
+    Utf8Carry | Utf8TooLarge | Utf8TooLarge1000 | Utf8Surrogate,
+    Utf8Carry | Utf8TooLarge | Utf8TooLarge1000,
+    Utf8Carry | Utf8TooLarge | Utf8TooLarge1000
+};
+
+inline constexpr unsigned char Utf8SecondHigh[16] =
+{
+    Utf8TooShort, Utf8TooShort, Utf8TooShort, Utf8TooShort,
+    Utf8TooShort, Utf8TooShort, Utf8TooShort, Utf8TooShort,
+    Utf8TooLong | Utf8Overlong2 | Utf8TwoConts | Utf8Overlong3 | Utf8TooLarge1000 | Utf8Overlong4,
+    Utf8TooLong | Utf8Overlong2 | Utf8TwoConts | Utf8Overlong3 | Utf8TooLarge,
+    Utf8TooLong | Utf8Overlong2 | Utf8TwoConts | Utf8Surrogate | Utf8TooLarge,
+    Utf8TooLong | Utf8Overlong2 | Utf8TwoConts | Utf8Surrogate | Utf8TooLarge,
+    Utf8TooShort, Utf8TooShort, Utf8TooShort, Utf8TooShort
+};
+
+inline bool Utf8ErrorAt(unsigned char third, unsigned char second, unsigned char first, unsigned char sim)
+{
+    unsigned char special = Utf8FirstHigh[first >> 4] & Utf8FirstLow[first & 0x0F] & Utf8SecondHigh[sim >> 4];
+    unsigned char continuation = (second >= 0xE0 || third >= 0xF0) ? 0x80 : 0;
+    return (special ^ continuation) != 0;
+}
+
+// Validates data given the three bytes before it in context; the start of
+// input is passed as three zero bytes
+inline bool ValidateUtf8Scalar(const char* data, size_t size, const unsigned char* context)
+{
+    unsigned char third = context[0];
+    unsigned char second = context[1];
+    unsigned char first = context[2];
+    bool error = false;
+    for (size_t pos = 0; pos < size; pos++)
+    {
+        unsigned char sim = static_cast<unsigned char>(data[pos]);
+        error |= Utf8ErrorAt(third, second, first, sim);
+        third = second;
+        second = first;
+        first = sim;
+    }
+    return !error;
+}
+
+inline void Utf8Context(const char* data, size_t pos, const unsigned char* context, unsigned char* window)
+{
+    for (size_t back = 0; back < 3; back++)
+    {
+        size_t distance = 3 - back;
+        window[back] = pos >= distance ? static_cast<unsigned char>(data[pos - distance]) : context[back + pos];
+    }
+}
+
+#ifdef WORDCOUNT_X86
+__attribute__((target("sse2")))
+inline size_t CountUtf8Sse2(const char* data, size_t size)
+{
+    // Signed, leads are 0xC2 to 0xF4 and printable ASCII 0x20 to 0x7E
+    const __m128i beforeLead = _mm_set1_epi8(-63);
+    const __m128i afterLead = _mm_set1_epi8(-11);
+    const __m128i beforeSpace = _mm_set1_epi8(0x1F);
+    const __m128i del = _mm_set1_epi8(0x7F);
+    size_t count = 0;
+    size_t pos = 0;
+    while (size - pos >= 16)
+    {
+        __m128i lanes = _mm_setzero_si128();
+        size_t end = pos + std::min<size_t>((size - pos) / 16, 255) * 16;
+        for (; pos < end; pos += 16)
+        {
+            __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + pos));
+            __m128i printable = _mm_andnot_si128(_mm_cmpeq_epi8(chunk, del), _mm_cmpgt_epi8(chunk, beforeSpace));
+            __m128i lead = _mm_and_si128(_mm_cmpgt_epi8(chunk, beforeLead), _mm_cmpgt_epi8(afterLead, chunk));
+            lanes = _mm_sub_epi8(lanes, _mm_or_si128(printable, lead));
+        }
+        __m128i sums = _mm_sad_epu8(lanes, _mm_setzero_si128());
+        count += static_cast<size_t>(_mm_cvtsi128_si32(sums) + _mm_extract_epi16(sums, 4));
+    }
+    return count + CountUtf8Scalar(data + pos, size - pos);
+}
+
+__attribute__((target("avx2")))
+inline size_t CountUtf8Avx2(const char* data, size_t size)
+{
+    const __m256i beforeLead = _mm256_set1_epi8(-63);
+    const __m256i afterLead = _mm256_set1_epi8(-11);
+    const __m256i beforeSpace = _mm256_set1_epi8(0x1F);
+    const __m256i del = _mm256_set1_epi8(0x7F);
+    size_t count = 0;
+    size_t pos = 0;
+    while (size - pos >= 32)
+    {
+        __m256i lanes = _mm256_setzero_si256();
+        size_t end = pos + std::min<size_t>((size - pos) / 32, 255) * 32;
+        for (; pos < end; pos += 32)
+        {
+            __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + pos));
+            __m256i printable = _mm256_andnot_si256(_mm256_cmpeq_epi8(chunk, del), _mm256_cmpgt_epi8(chunk, beforeSpace));
+            __m256i lead = _mm256_and_si256(_mm256_cmpgt_epi8(chunk, beforeLead), _mm256_cmpgt_epi8(afterLead, chunk));
+            lanes = _mm256_sub_epi8(lanes, _mm256_or_si256(printable, lead));
+        }
+        __m256i sums = _mm256_sad_epu8(lanes, _mm256_setzero_si256());
+        __m128i halves = _mm_add_epi64(_mm256_castsi256_si128(sums), _mm256_extracti128_si256(sums, 1));
+        count += static_cast<size_t>(_mm_cvtsi128_si32(halves) + _mm_extract_epi16(halves, 4));
+    }
+    return count + CountUtf8Scalar(data + pos, size - pos);
+}
+
+__attribute__((target("avx512bw,popcnt")))
+inline size_t CountUtf8Avx512(const char* data, size_t size)
+{
+    const __m512i space = _mm512_set1_epi8(0x20);
+    const __m512i del = _mm512_set1_epi8(0x7F);
+    const __m512i firstLead = _mm512_set1_epi8(static_cast<char>(0xC2));
+    const __m512i lastLead = _mm512_set1_epi8(static_cast<char>(0xF4));
+    size_t count = 0;
+    size_t pos = 0;
+    for (; size - pos >= 64; pos += 64)
+    {
+        __m512i chunk = _mm512_loadu_si512(data + pos);
+        __mmask64 printable = _mm512_cmpge_epu8_mask(chunk, space) & _mm512_cmplt_epu8_mask(chunk, del);
+        __mmask64 lead = _mm512_cmpge_epu8_mask(chunk, firstLead) & _mm512_cmple_epu8_mask(chunk, lastLead);
+        __mmask64 counted = printable | lead;
+        count += _mm_popcnt_u64(counted);
+    }
+    return count + CountUtf8Scalar(data + pos, size - pos);
+}
+
+template <int N>
+__attribute__((target("avx2")))
+inline __m256i PreviousBytesAvx2(__m256i input, __m256i previous)
+{
+    return _mm256_alignr_epi8(input, _mm256_permute2x128_si256(previous, input, 0x21), 16 - N);
+}
+
+__attribute__((target("avx2")))
+inline __m256i Lookup16Avx2(const unsigned char* table, __m256i index)
+{
+    __m256i lookup = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(table)));
+    return _mm256_shuffle_epi8(lookup, index);
+}
+
+__attribute__((target("avx2")))
+inline bool ValidateUtf8Avx2(const char* data, size_t size, const unsigned char* context)
+{
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    alignas(32) unsigned char last[32] = {};
+    memcpy(last + 29, context, 3);
+    __m256i previous = _mm256_load_si256(reinterpret_cast<const __m256i*>(last));
+    __m256i error = _mm256_setzero_si256();
+    size_t pos = 0;
+    for (; size - pos >= 32; pos += 32)
+    {
+        __m256i input = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + pos));
+        // ASCII after ASCII can not be wrong
+        if (_mm256_movemask_epi8(input) == 0 && (static_cast<unsigned>(_mm256_movemask_epi8(previous)) >> 29) == 0)
+        {
+            previous = input;
+            continue;
+        }
+        __m256i first = PreviousBytesAvx2<1>(input, previous);
+        __m256i special = _mm256_and_si256(
+            _mm256_and_si256(
+                Lookup16Avx2(Utf8FirstHigh, _mm256_and_si256(_mm256_srli_epi16(first, 4), nibble)),
+                Lookup16Avx2(Utf8FirstLow, _mm256_and_si256(first, nibble))),
+            Lookup16Avx2(Utf8SecondHigh, _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble)));
+        __m256i third = _mm256_subs_epu8(PreviousBytesAvx2<2>(input, previous), _mm256_set1_epi8(static_cast<char>(0xE0 - 0x80)));
+        __m256i fourth = _mm256_subs_epu8(PreviousBytesAvx2<3>(input, previous), _mm256_set1_epi8(static_cast<char>(0xF0 - 0x80)));
+        __m256i continuation = _mm256_and_si256(_mm256_or_si256(third, fourth), _mm256_set1_epi8(static_cast<char>(0x80)));
+        error = _mm256_or_si256(error, _mm256_xor_si256(special, continuation));
+        previous = input;
+    }
+    if (!_mm256_testz_si256(error, error))
+        return false;
+    unsigned char window[3];
+    Utf8Context(data, pos, context, window);
+    return ValidateUtf8Scalar(data + pos, size - pos, window);
+}
+#endif
+
+// Counting kernels picked once at startup for the best instruction set
+// the CPU supports, or the one forced with --simd
+struct CounterKernels
+{
+    size_t (*countByte)(const char* data, size_t size, char byte) = CountByteScalar;
+    unsigned long long (*byteMask)(const char* data, char byte) = ByteMask64Scalar;
+    size_t (*countWordStarts)(const char* data, size_t size, bool& inWord) = CountWordStartsScalar;
+    unsigned long long (*wordMask)(const char* data) = WordMask64Scalar;
+    size_t (*countSubstring)(const char* data, size_t size, const char* pattern, size_t length) = CountSubstringScalar;
+    size_t (*countUtf8)(const char* data, size_t size) = CountUtf8Scalar;
+    bool (*validateUtf8)(const char* data, size_t size, const unsigned char* context) = ValidateUtf8Scalar;
+};
+
+inline CounterKernels Kernels;
+
+inline bool SimdSupported(SimdLevel level)
+{
+#ifdef WORDCOUNT_X86
+    __builtin_cpu_init();
+    switch (level)
+    {
+        case SimdLevel::AUTO:
+        case SimdLevel::SCALAR:
+            return true;
+        case SimdLevel::SSE2:
+            return __builtin_cpu_supports("sse2");
+        case SimdLevel::AVX2:
+            return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+        case SimdLevel::AVX512:
+            return __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("popcnt");
+    }
+    return false;
+#else
+    return level == SimdLevel::AUTO || level == SimdLevel::SCALAR;
+#endif
+}
+
+inline void SelectKernels(SimdLevel level)
+{
+    if (level == SimdLevel::AUTO)
+    {
+        for (SimdLevel best : { SimdLevel::AVX512, SimdLevel::AVX2, SimdLevel::SSE2, SimdLevel::SCALAR })
+        {
+            if (SimdSupported(best))
+            {
+                level = best;
+                break;
+            }
+        }
+    }
+    else if (!SimdSupported(level))
+    {
+        throw InvalidModifier("Instruction set for --simd is not supported by this CPU");
+    }
+
+    Kernels = CounterKernels();
+#ifdef WORDCOUNT_X86
+    switch (level)
+    {
+        case SimdLevel::AVX512:
+            Kernels.countByte = CountByteAvx512;
+            Kernels.byteMask = ByteMask64Avx512;
+            Kernels.countSubstring = CountSubstringAvx512;
+            Kernels.countUtf8 = CountUtf8Avx512;
+            Kernels.validateUtf8 = ValidateUtf8Avx2;
+            if (SpaceByNibbles)
+            {
+                Kernels.countWordStarts = CountWordStartsAvx512;
+                Kernels.wordMask = WordMask64Avx2;
+            }
+            break;
+        case SimdLevel::AVX2:
+            Kernels.countByte = CountByteAvx2;
+            Kernels.byteMask = ByteMask64Avx2;
+            Kernels.countSubstring = CountSubstringAvx2;
+            Kernels.countUtf8 = CountUtf8Avx2;
+            Kernels.validateUtf8 = ValidateUtf8Avx2;
+            if (SpaceByNibbles)
+            {
+                Kernels.countWordStarts = CountWordStartsAvx2;
+                Kernels.wordMask = WordMask64Avx2;
+            }
+            break;
+        case SimdLevel::SSE2:
+            Kernels.countByte = CountByteSse2;
+            Kernels.byteMask = ByteMask64Sse2;
+            Kernels.countSubstring = CountSubstringSse2;
+            Kernels.countUtf8 = CountUtf8Sse2;
+            if (SpaceIsAscii)
+            {
+                Kernels.countWordStarts = CountWordStartsSse2;
+                Kernels.wordMask = WordMask64Sse2;
+            }
+            break;
+        default:
+            break;
+    }
+#endif
+}
+
+// Counts overlapping occurrences of one pattern. Single bytes go to the
+// byte-counting kernel and longer patterns to the first/last byte
+// prefilter. Without vector kernels, long patterns use Boyer-Moore-Horspool
+// instead: its shifts come from the whole pattern, so they never skip an
+// overlapping match. The vector prefilter beats Horspool at every length.
+class SubstringMatcher
+{
+private:
+    static constexpr size_t LongPattern = 16;
+
+    std::string pattern;
+    size_t skip[256];
+
+    unsigned long long HorspoolCount(std::string_view text) const
+    {
+        size_t length = pattern.length();
+        unsigned long long count = 0;
+        size_t pos = 0;
+        while (pos + length <= text.length())
+        {
+            unsigned char last = static_cast<unsigned char>(text[pos + length - 1]);
+            if (last == static_cast<unsigned char>(pattern[length - 1])
+                && memcmp(text.data() + pos, pattern.data(), length - 1) == 0)
+                count++;
+            pos += skip[last];
+        }
+        return count;
+    }
+public:
+    explicit SubstringMatcher(const std::string& pattern)
+        : pattern(pattern)
+    {
+        size_t length = pattern.length();
+        std::fill(std::begin(skip), std::end(skip), length);
+        for (size_t pos = 0; pos + 1 < length; pos++)
+            skip[static_cast<unsigned char>(pattern[pos])] = length - 1 - pos;
+    }
+
+    size_t Length() const
+    {
+        return pattern.length();
+    }
+
+    unsigned long long Count(std::string_view text) const
+    {
+        if (pattern.length() == 1)
+            return Kernels.countByte(text.data(), text.length(), pattern[0]);
+        if (pattern.length() >= LongPattern && Kernels.countSubstring == CountSubstringScalar)
+            return HorspoolCount(text);
+        return Kernels.countSubstring(text.data(), text.length(), pattern.data(), pattern.length());
+    }
+};
+
+// A set of patterns counted in one pass, each with its own count
+class PatternCounter
+{
+public:
+    virtual ~PatternCounter() = default;
+
+    virtual size_t MaxLength() const = 0;
+
+    // Adds the occurrences of every pattern that lie entirely inside text.
+    // Counters are shared between threads, so working memory that outlives
+    // a call is the caller's scratch.
+    virtual void Count(std::string_view text, unsigned long long* counts, std::vector<unsigned long long>& scratch) const = 0;
+};
+
+// A few patterns are faster to count one after another with the vector
+// prefilter than with an automaton that steps through every byte
+class MatcherList: public PatternCounter
+{
+private:
+    std::vector<SubstringMatcher> matchers;
+    size_t maxLength = 0;
+public:
+    explicit MatcherList(const std::vector<std::string>& patterns)
+    {
+        for (const std::string& pattern : patterns)
+        {
+            matchers.emplace_back(pattern);
+            maxLength = std::max(maxLength, pattern.length());
+        }
+    }
+
+    size_t MaxLength() const override
+    {
+        return maxLength;
+    }
+
+    void Count(std::string_view text, unsigned long long* counts, std::vector<unsigned long long>&) const override
+    {
+        for (size_t index = 0; index < matchers.size(); index++)
+            counts[index] += matchers[index].Count(text);
+    }
+};
+
+// Aho-Corasick automaton compiled to a dense transition table. Bytes that
+// occur in no pattern share one class, so a row has one entry per distinct
+// pattern byte plus one, padded to a power of two so that a row starts at
+// state << shift. An entry holds the next state with the top bit set when
+// some pattern ends there.
+//
+// The scan only bumps a hit counter for such output states. Hits are then
+// pushed down the dictionary links, from the deepest states to the
+// shallowest, and each pattern reads the hits of the state it ends in.
+class AhoCorasick: public PatternCounter
+{
+private:
+    static constexpr uint32_t OutputFlag = 1u << 31;
+    static constexpr uint32_t NoOutput = ~0u;
+
+    size_t patterns = 0;
+    size_t maxLength = 0;
+    unsigned char classOf[256] {};
+    unsigned shift = 0;
+    std::vector<uint32_t> table;
+    // Output index of every state, in breadth-first order of the states
+    std::vector<uint32_t> outputOf;
+    // Output index of the longest proper suffix that also ends a pattern
+    std::vector<uint32_t> dictionaryLink;
+    std::vector<uint32_t> patternOutput;
+public:
+    explicit AhoCorasick(const std::vector<std::string>& patternList)
+        : patterns(patternList.size())
+    {
+        bool used[256] {};
+        for (const std::string& pattern : patternList)
+        {
+            maxLength = std::max(maxLength, pattern.length());
+            for (char sim : pattern)
+                used[static_cast<unsigned char>(sim)] = true;
+        }
+        unsigned classes = 1;
+        for (int sim = 0; sim < 256; sim++)
+        {
+            if (used[sim])
+                classOf[sim] = static_cast<unsigned char>(classes++);
+        }
+        while ((1u << shift) < classes)
+            shift++;
+        size_t width = size_t(1) << shift;
+
+        // Trie: 0 is the root and means "no child" while building
+        table.assign(width, 0);
+        std::vector<uint32_t> parent(1, 0);
+        std::vector<uint32_t> terminal(patterns);
+        std::vector<bool> ends(1, false);
+        for (size_t index = 0; index < patterns; index++)
+        {
+            uint32_t state = 0;
+            for (char sim : patternList[index])
+            {
+                size_t slot = (size_t(state) << shift) | classOf[static_cast<unsigned char>(sim)];
+                if (table[slot] == 0)
+                {
+                    table[slot] = static_cast<uint32_t>(parent.size());
+                    parent.push_back(state);
+                    ends.push_back(false);
+                    table.resize(table.size() + width, 0);
+                }
+                state = table[slot];
+            }
+            ends[state] = true;
+            terminal[index] = state;
+        }
+        if (parent.size() >= OutputFlag)
+            throw InvalidModifier("Too many patterns for --substring");
+
+        // Breadth-first pass: failure links complete the rows into a DFA
+        size_t states = parent.size();
+        std::vector<uint32_t> fail(states, 0);
+        std::vector<uint32_t> order;
+        order.reserve(states);
+        order.push_back(0);
+        for (size_t next = 0; next < order.size(); next++)
+        {
+            uint32_t state = order[next];
+            for (size_t sim = 0; sim < width; sim++)
+            {
+                size_t slot = (size_t(state) << shift) | sim;
+                uint32_t child = table[slot];
+                if (child != 0 && parent[child] == state)
+                {
+                    fail[child] = state == 0 ? 0 : table[(size_t(fail[state]) << shift) | sim];
+                    order.push_back(child);
+                }
+                else
+                {
+                    table[slot] = state == 0 ? 0 : table[(size_t(fail[state]) << shift) | sim];
+                }
+            }
+        }
+
+        outputOf.assign(states, NoOutput);
+        for (uint32_t state : order)
+        {
+            if (ends[state] || (state != 0 && outputOf[fail[state]] != NoOutput))
+            {
+                outputOf[state] = static_cast<uint32_t>(dictionaryLink.size());
+                uint32_t suffix = fail[state];
+                while (suffix != 0 && !ends[suffix])
+                    suffix = fail[suffix];
+                dictionaryLink.push_back(suffix != 0 ? outputOf[suffix] : NoOutput);
+            }
+        }
+        for (uint32_t& entry : table)
+        {
+            if (outputOf[entry] != NoOutput)
+                entry |= OutputFlag;
+        }
+        patternOutput.resize(patterns);
+        for (size_t index = 0; index < patterns; index++)
+            patternOutput[index] = outputOf[terminal[index]];
+    }
+
+    size_t MaxLength() const override
+    {
+        return maxLength;
+    }
+
+    void Count(std::string_view text, unsigned long long* counts, std::vector<unsigned long long>& hits) const override
+    {
+        hits.assign(dictionaryLink.size(), 0);
+        const uint32_t* rows = table.data();
+        const unsigned char* data = reinterpret_cast<const unsigned char*>(text.data());
+        size_t size = text.size();
+        size_t pos = 0;
+        uint32_t state = 0;
+        // Two automata step through the two halves of the text together, so
+        // that their table lookups overlap. The second one starts
+        // maxLength - 1 bytes before its half without counting, which is
+        // enough context for every match that ends inside the half.
+        size_t overlap = maxLength - 1;
+        if (size >= 4 * maxLength + 64)
+        {
+            size_t half = size / 2;
+            uint32_t second = 0;
+            for (size_t prime = half - overlap; prime < half; prime++)
+                second = rows[(size_t(second) << shift) | classOf[data[prime]]] & ~OutputFlag;
+            for (; pos < half; pos++)
+            {
+                uint32_t next = rows[(size_t(state) << shift) | classOf[data[pos]]];
+                uint32_t nextSecond = rows[(size_t(second) << shift) | classOf[data[half + pos]]];
+                state = next & ~OutputFlag;
+                second = nextSecond & ~OutputFlag;
+                if (next & OutputFlag)
+                    hits[outputOf[state]]++;
+                if (nextSecond & OutputFlag)
+                    hits[outputOf[second]]++;
+            }
+            pos = 2 * half;
+            state = second;
+        }
+        for (; pos < size; pos++)
+        {
+            uint32_t next = rows[(size_t(state) << shift) | classOf[data[pos]]];
+            state = next & ~OutputFlag;
+            if (next & OutputFlag)
+                hits[outputOf[state]]++;
+        }
+        for (size_t output = hits.size(); output-- > 0;)
+        {
+            if (hits[output] != 0 && dictionaryLink[output] != NoOutput)
+                hits[dictionaryLink[output]] += hits[output];
+        }
+        for (size_t index = 0; index < patterns; index++)
+            counts[index] += hits[patternOutput[index]];
+    }
+};
+
+inline std::shared_ptr<const PatternCounter> MakePatternCounter(const std::vector<std::string>& patterns)
+{
+    static constexpr size_t MaxMatchers = 4;
+
+    if (patterns.size() <= MaxMatchers)
+        return std::make_shared<const MatcherList>(patterns);
+    return std::make_shared<const AhoCorasick>(patterns);
+}
+
+// A fast non-cryptographic hash for words: eight bytes at a time folded
+// with 64x64->128 bit multiplications. The last bytes are read with
+// fixed-size loads that may overlap, never a byte-by-byte loop. The length
+// gets a round of its own, since the chunk of a short word uses the same
+// bits a plain XOR of it would.
+inline unsigned long long MixWord(unsigned long long left, unsigned long long right)
+{
+    unsigned __int128 product = static_cast<unsigned __int128>(left) * right;
+    return static_cast<unsigned long long>(product) ^ static_cast<unsigned long long>(product >> 64);
+}
+
+inline unsigned long long HashWord(const char* data, size_t length)
+{
+    unsigned long long hash = MixWord(0x9E3779B97F4A7C15ULL ^ length, 0xA0761D6478BD642FULL);
+    unsigned long long chunk = 0;
+    if (length >= 8)
+    {
+        size_t pos = 0;
+        for (; pos + 8 < length; pos += 8)
+        {
+            memcpy(&chunk, data + pos, 8);
+            hash = MixWord(hash ^ chunk, 0xA0761D6478BD642FULL);
+        }
+        memcpy(&chunk, data + length - 8, 8);
+    }
+    else if (length >= 4)
+    {
+        uint32_t first;
+        uint32_t last;
+        memcpy(&first, data, 4);
+        memcpy(&last, data + length - 4, 4);
+        chunk = static_cast<unsigned long long>(first) << 32 | last;
+    }
+    else if (length > 0)
+    {
+        const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+        chunk = static_cast<unsigned long long>(bytes[0]) << 16 | static_cast<unsigned long long>(bytes[length / 2]) << 8
+            | bytes[length - 1];
+    }
+    return MixWord(hash ^ chunk, 0xE7037ED1A0B428DBULL);
+}
+
+// FNV-1a, seeded so that fields can be chained
+inline unsigned long long HashBytes(const void* data, size_t size, unsigned long long hash = 14695981039346656037ULL)
+{
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    for (size_t pos = 0; pos < size; pos++)
+    {
+        hash ^= bytes[pos];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Occurrences of every distinct word for --freq. Open addressing with
+// linear probing over a power-of-two array; the words are appended to one
+// arena and entries refer to them by offset, so there is no allocation per
+// word and a table copies or merges as plain arrays.
+class WordTable
+{
+private:
+    struct Entry
+    {
+        unsigned long long hash;
+        // Zero for a free slot
+        unsigned long long count;
+        unsigned long long offset;
+        unsigned long long length;
+    };
+
+    std::vector<Entry> entries;
+    std::vector<char> arena;
+    size_t used = 0;
+
+    std::string_view Word(const Entry& entry) const
+    {
+        return std::string_view(arena.data() + entry.offset, static_cast<size_t>(entry.length));
+    }
+
+    void Grow()
+    {
+        std::vector<Entry> old = std::move(entries);
+        entries.assign(std::max<size_t>(1024, old.size() * 2), Entry {});
+        size_t mask = entries.size() - 1;
+        for (const Entry& entry : old)
+        {
+            if (entry.count == 0)
+                continue;
+            size_t pos = entry.hash & mask;
+            while (entries[pos].count != 0)
+                pos = (pos + 1) & mask;
+            entries[pos] = entry;
+        }
+    }
+
+public:
+    void Add(std::string_view word, unsigned long long count, unsigned long long hash)
+    {
+        // Kept at most half full so that probes stay short
+        if ((used + 1) * 2 > entries.size())
+            Grow();
+        size_t mask = entries.size() - 1;
+        for (size_t pos = hash & mask; ; pos = (pos + 1) & mask)
+        {
+            Entry& entry = entries[pos];
+            if (entry.count == 0)
+            {
+                entry = { hash, count, arena.size(), word.length() };
+                arena.insert(arena.end(), word.begin(), word.end());
+                used++;
+                return;
+            }
+            if (entry.hash == hash && Word(entry) == word)
+            {
+                entry.count += count;
+                return;
+            }
+        }
+    }
+
+    void Add(std::string_view word, unsigned long long count = 1)
+    {
+        Add(word, count, HashWord(word.data(), word.length()));
+    }
+
+    // Bytes held by the table and its words
+    size_t Memory() const
+    {
+        return entries.capacity() * sizeof(Entry) + arena.capacity();
+    }
+
+    template <typename Visit>
+    void ForEach(Visit visit) const
+    {
+        for (const Entry& entry : entries)
+        {
+            if (entry.count != 0)
+                visit(Word(entry), entry.count, entry.hash);
+        }
+    }
+
+    unsigned long long Find(std::string_view word) const
+    {
+        if (entries.empty())
+            return 0;
+        unsigned long long hash = HashWord(word.data(), word.length());
+        size_t mask = entries.size() - 1;
+        for (size_t pos = hash & mask; entries[pos].count != 0; pos = (pos + 1) & mask)
+        {
+            if (entries[pos].hash == hash && Word(entries[pos]) == word)
+                return entries[pos].count;
+        }
+        return 0;
+    }
+
+    void Merge(const WordTable& other)
+    {
+        for (const Entry& entry : other.entries)
+        {
+            if (entry.count != 0)
+                Add(other.Word(entry), entry.count, entry.hash);
+        }
+    }
+
+    // The most frequent words, ties in byte order
+    std::vector<std::pair<std::string, unsigned long long>> Top(size_t top) const
+    {
+        std::vector<const Entry*> found;
+        found.reserve(used);
+        for (const Entry& entry : entries)
+        {
+            if (entry.count != 0)
+                found.push_back(&entry);
+        }
+        top = std::min(top, found.size());
+        std::partial_sort(found.begin(), found.begin() + static_cast<ptrdiff_t>(top), found.end(),
+                          [this](const Entry* left, const Entry* right)
+                          {
+                              if (left->count != right->count)
+                                  return left->count > right->count;
+                              return Word(*left) < Word(*right);
+                          });
+        std::vector<std::pair<std::string, unsigned long long>> result;
+        for (size_t index = 0; index < top; index++)
+            result.emplace_back(std::string(Word(*found[index])), found[index]->count);
+        return result;
+    }
+
+    void Save(std::ostream& out) const
+    {
+        unsigned long long size = used;
+        out.write(reinterpret_cast<const char*>(&size), sizeof(size));
+        for (const Entry& entry : entries)
+        {
+            if (entry.count == 0)
+                continue;
+            unsigned long long fields[] = { entry.count, entry.length };
+            out.write(reinterpret_cast<const char*>(fields), sizeof(fields));
+            out.write(arena.data() + entry.offset, static_cast<std::streamsize>(entry.length));
+        }
+    }
+
+    bool Load(std::istream& in)
+    {
+        unsigned long long size;
+        if (!in.read(reinterpret_cast<char*>(&size), sizeof(size)))
+            return false;
+        std::string word;
+        for (unsigned long long index = 0; index < size; index++)
+        {
+            unsigned long long fields[2];
+            if (!in.read(reinterpret_cast<char*>(fields), sizeof(fields)) || fields[0] == 0 || fields[1] > (1 << 20))
+                return false;
+            word.resize(static_cast<size_t>(fields[1]));
+            if (!in.read(word.data(), static_cast<std::streamsize>(word.length())))
+                return false;
+            Add(word, fields[0]);
+        }
+        return true;
+    }
+};
+
+// Approximate number of distinct items for --distinct-words and
+// --distinct-lines: HyperLogLog over 2^precision one-byte registers, with
+// a standard error of about 1.04 / sqrt(2^precision) in fixed memory.
+// Sketches of different ranges or files merge by keeping the larger of
+// every register, which is exactly the sketch of all their items.
+class HyperLogLog
+{
+private:
+    unsigned precision = 0;
+    std::vector<unsigned char> registers;
+public:
+    HyperLogLog() = default;
+
+    explicit HyperLogLog(unsigned precision)
+        : precision(precision), registers(static_cast<size_t>(1) << precision, 0)
+    {
+    }
+
+    // The top bits of the hash pick a register, which keeps the longest
+    // run of leading zeros seen in the rest
+    void Add(unsigned long long hash)
+    {
+        size_t index = static_cast<size_t>(hash >> (64 - precision));
+        unsigned long long rest = hash << precision;
+        unsigned char rank = static_cast<unsigned char>(rest == 0 ? 64 - precision + 1 : __builtin_clzll(rest) + 1);
+        registers[index] = std::max(registers[index], rank);
+    }
+
+    void Merge(const HyperLogLog& other)
+    {
+        if (registers.empty())
+        {
+            *this = other;
+            return;
+        }
+        for (size_t index = 0; index < registers.size() && index < other.registers.size(); index++)
+            registers[index] = std::max(registers[index], other.registers[index]);
+    }
+
+    unsigned Precision() const
+    {
+        return precision;
+    }
+
+    // Small cardinalities, where many registers are still empty, are
+    // estimated by linear counting instead
+    unsigned long long Estimate() const
+    {
+        if (registers.empty())
+            return 0;
+        double size = static_cast<double>(registers.size());
+        double sum = 0;
+        size_t zeros = 0;
+        for (unsigned char rank : registers)
+        {
+            sum += ldexp(1.0, -rank);
+            zeros += rank == 0;
+        }
+        double alpha = registers.size() == 16 ? 0.673
+            : registers.size() == 32 ? 0.697
+            : registers.size() == 64 ? 0.709
+            : 0.7213 / (1 + 1.079 / size);
+        double estimate = alpha * size * size / sum;
+        if (estimate <= 2.5 * size && zeros > 0)
+            estimate = size * log(size / static_cast<double>(zeros));
+        return static_cast<unsigned long long>(llround(estimate));
+    }
+
+    void Save(std::ostream& out) const
+    {
+        unsigned long long saved = precision;
+        out.write(reinterpret_cast<const char*>(&saved), sizeof(saved));
+        out.write(reinterpret_cast<const char*>(registers.data()), static_cast<std::streamsize>(registers.size()));
+    }
+
+    // Registers of another precision can not be read into these
+    bool Load(std::istream& in)
+    {
+        unsigned long long saved;
+        if (!in.read(reinterpret_cast<char*>(&saved), sizeof(saved)) || saved != precision)
+            return false;
+        return static_cast<bool>(in.read(reinterpret_cast<char*>(registers.data()),
+                                         static_cast<std::streamsize>(registers.size())));
+    }
+};
+
+// The most frequent words or lines for --heavy-hitters and --heavy-lines
+// within a memory cap. Items are counted exactly until their table would
+// take half the cap, and from then on in a Count-Min sketch of Depth rows
+// that overestimates any count by at most e / width of all the items with
+// probability 1 - e^-Depth. Next to it a few times top candidates are
+// kept, those whose estimate beat the smallest one on the list when they
+// were last seen. Counters of equal width add up, so sketches of ranges
+// and files merge into the sketch of all of them.
+class HeavyHitters
+{
+private:
+    static constexpr size_t Depth = 4;
+    // Items are told apart by their first MaxItemLength bytes
+    static constexpr size_t MaxItemLength = 1024;
+
+    size_t memory = 0;
+    size_t capacity = 0;
+    unsigned long long total = 0;
+    WordTable exact;
+    bool sketched = false;
+    size_t width = 0;
+    std::vector<unsigned long long> counters;
+    // Items with their hashes; items whose hashes collide stay apart here
+    // even though they share counters
+    std::unordered_map<std::string, unsigned long long> candidates;
+    unsigned long long threshold = 0;
+
+    size_t Slot(size_t row, unsigned long long hash) const
+    {
+        unsigned long long mixed = hash + row * ((hash >> 32) | 1);
+        return row * width + static_cast<size_t>((static_cast<unsigned __int128>(mixed * 0x9E3779B97F4A7C15ULL) * width) >> 64);
+    }
+
+    unsigned long long Estimate(unsigned long long hash) const
+    {
+        unsigned long long estimate = ~0ULL;
+        for (size_t row = 0; row < Depth; row++)
+            estimate = std::min(estimate, counters[Slot(row, hash)]);
+        return estimate;
+    }
+
+    void SketchAdd(std::string_view item, unsigned long long hash, unsigned long long count)
+    {
+        unsigned long long estimate = ~0ULL;
+        for (size_t row = 0; row < Depth; row++)
+        {
+            unsigned long long& counter = counters[Slot(row, hash)];
+            counter += count;
+            estimate = std::min(estimate, counter);
+        }
+        if (estimate <= threshold)
+            return;
+        candidates.try_emplace(std::string(item), hash);
+        if (candidates.size() > 2 * capacity)
+            Prune();
+    }
+
+    // Keeps the capacity candidates with the highest estimates, the lowest
+    // of which becomes the bar for new ones
+    void Prune()
+    {
+        if (candidates.size() <= capacity)
+            return;
+        std::vector<std::pair<unsigned long long, const std::string*>> ranked;
+        ranked.reserve(candidates.size());
+        for (const auto& pair_item_hash : candidates)
+            ranked.emplace_back(Estimate(pair_item_hash.second), &pair_item_hash.first);
+        std::nth_element(ranked.begin(), ranked.begin() + static_cast<ptrdiff_t>(capacity - 1), ranked.end(),
+                         [](const std::pair<unsigned long long, const std::string*>& left,
+                            const std::pair<unsigned long long, const std::string*>& right)
+                         {
+                             return left.first > right.first;
+                         });
+        threshold = std::max(threshold, ranked[capacity - 1].first);
+        std::vector<std::string> pruned;
+        for (size_t index = capacity; index < ranked.size(); index++)
+            pruned.push_back(*ranked[index].second);
+        for (const std::string& item : pruned)
+            candidates.erase(item);
+    }
+
+    // Moves the exact counts into the sketch once they outgrow their share
+    void Spill()
+    {
+        sketched = true;
+        counters.assign(Depth * width, 0);
+        WordTable counted = std::move(exact);
+        exact = WordTable();
+        counted.ForEach([this](std::string_view item, unsigned long long count, unsigned long long hash)
+                        {
+                            SketchAdd(item, hash, count);
+                        });
+    }
+public:
+    HeavyHitters() = default;
+
+    HeavyHitters(size_t memory, size_t top)
+        : memory(memory), capacity(std::max<size_t>(64, 4 * top)), width(Width(memory, top))
+    {
+    }
+
+    // Counters per row that fit besides the candidates, zero when they do not
+    static size_t Width(size_t memory, size_t top)
+    {
+        size_t reserved = 2 * std::max<size_t>(64, 4 * top) * (MaxItemLength + 64);
+        return memory > reserved ? (memory - reserved) / (Depth * sizeof(unsigned long long)) : 0;
+    }
+
+    static unsigned long long Hash(std::string_view item)
+    {
+        return HashWord(item.data(), std::min(item.length(), MaxItemLength));
+    }
+
+    // Sketches of one shape save and load each other's state
+    unsigned long long Shape() const
+    {
+        unsigned long long sizes[] = { memory, capacity, width };
+        return HashBytes(sizes, sizeof(sizes));
+    }
+
+    void Add(std::string_view item, unsigned long long hash, unsigned long long count = 1)
+    {
+        item = item.substr(0, MaxItemLength);
+        total += count;
+        if (sketched)
+        {
+            SketchAdd(item, hash, count);
+            return;
+        }
+        exact.Add(item, count, hash);
+        if (exact.Memory() > memory / 2)
+            Spill();
+    }
+
+    void Merge(const HeavyHitters& other)
+    {
+        if (memory == 0)
+        {
+            *this = other;
+            return;
+        }
+        if (!other.sketched)
+        {
+            other.exact.ForEach([this](std::string_view item, unsigned long long count, unsigned long long hash)
+                                {
+                                    Add(item, hash, count);
+                                });
+            return;
+        }
+        if (!sketched)
+        {
+            HeavyHitters merged = other;
+            exact.ForEach([&merged](std::string_view item, unsigned long long count, unsigned long long hash)
+                          {
+                              merged.Add(item, hash, count);
+                          });
+            *this = std::move(merged);
+            return;
+        }
+        total += other.total;
+        for (size_t index = 0; index < counters.size(); index++)
+            counters[index] += other.counters[index];
+        for (const auto& pair_item_hash : other.candidates)
+            candidates.insert(pair_item_hash);
+        Prune();
+    }
+
+    // The candidates with the highest counts, ties in byte order
+    RankedItems Top(size_t top) const
+    {
+        RankedItems result;
+        if (!sketched)
+        {
+            result.items = exact.Top(top);
+            return result;
+        }
+        for (const auto& pair_item_hash : candidates)
+            result.items.emplace_back(pair_item_hash.first, Estimate(pair_item_hash.second));
+        std::sort(result.items.begin(), result.items.end(),
+                  [](const std::pair<std::string, unsigned long long>& left, const std::pair<std::string, unsigned long long>& right)
+                  {
+                      if (left.second != right.second)
+                          return left.second > right.second;
+                      return left.first < right.first;
+                  });
+        if (result.items.size() > top)
+            result.items.resize(top);
+        result.error = static_cast<unsigned long long>(ceil(exp(1.0) * static_cast<double>(total) / static_cast<double>(width)));
+        return result;
+    }
+
+    void Save(std::ostream& out) const
+    {
+        unsigned long long fields[] = { sketched, total, threshold, candidates.size(), width };
+        out.write(reinterpret_cast<const char*>(fields), sizeof(fields));
+        if (!sketched)
+        {
+            exact.Save(out);
+            return;
+        }
+        out.write(reinterpret_cast<const char*>(counters.data()),
+                  static_cast<std::streamsize>(counters.size() * sizeof(unsigned long long)));
+        for (const auto& pair_item_hash : candidates)
+        {
+            unsigned long long length = pair_item_hash.first.length();
+            out.write(reinterpret_cast<const char*>(&length), sizeof(length));
+            out.write(pair_item_hash.first.data(), static_cast<std::streamsize>(length));
+        }
+    }
+
+    bool Load(std::istream& in)
+    {
+        unsigned long long fields[5];
+        // Rows of another width would be read with the wrong stride
+        if (!in.read(reinterpret_cast<char*>(fields), sizeof(fields)) || fields[4] != width)
+            return false;
+        total = fields[1];
+        threshold = fields[2];
+        if (fields[0] == 0)
+            return exact.Load(in);
+        sketched = true;
+        counters.assign(Depth * width, 0);
+        if (!in.read(reinterpret_cast<char*>(counters.data()),
+                     static_cast<std::streamsize>(counters.size() * sizeof(unsigned long long))))
+            return false;
+        std::string item;
+        for (unsigned long long index = 0; index < fields[3]; index++)
+        {
+            unsigned long long length;
+            if (!in.read(reinterpret_cast<char*>(&length), sizeof(length)) || length > MaxItemLength)
+                return false;
+            item.resize(static_cast<size_t>(length));
+            if (!in.read(item.data(), static_cast<std::streamsize>(length)))
+                return false;
+            candidates.emplace(item, Hash(item));
+        }
+        return true;
+    }
+};
+
+// The tokens at both ends of a range that may continue into its
+// neighbours: the first one, which is the whole range when it holds no
+// separator at all, and the last one. Only their first limit bytes are
+// kept, so longer tokens are told apart by that prefix.
+struct TokenEdges
+{
+    std::string first;
+    std::string last;
+    bool whole = false;
+
+    static void Extend(std::string& token, std::string_view more, size_t limit)
+    {
+        token.append(more.substr(0, limit - std::min(limit, token.length())));
+    }
+
+    // Joins the edges of the range that follows, those of this range
+    // being meaningless while it is still empty. The token closed by the
+    // join, if any, goes to complete.
+    template <typename Complete>
+    void Append(bool empty, size_t limit, bool nextWhole, std::string_view nextFirst, std::string_view nextLast,
+                Complete complete)
+    {
+        if (empty)
+        {
+            whole = nextWhole;
+            first.assign(nextFirst.substr(0, limit));
+            last.assign(nextLast.substr(0, limit));
+            return;
+        }
+        if (whole)
+        {
+            Extend(first, nextFirst, limit);
+            if (!nextWhole)
+            {
+                whole = false;
+                last.assign(nextLast.substr(0, limit));
+            }
+            return;
+        }
+        Extend(last, nextFirst, limit);
+        if (nextWhole)
+            return;
+        complete(last);
+        last.assign(nextLast.substr(0, limit));
+    }
+
+    void Save(std::ostream& out) const
+    {
+        unsigned long long fields[] = { whole, first.length(), last.length() };
+        out.write(reinterpret_cast<const char*>(fields), sizeof(fields));
+        out.write(first.data(), static_cast<std::streamsize>(first.length()));
+        out.write(last.data(), static_cast<std::streamsize>(last.length()));
+    }
+
+    bool Load(std::istream& in, size_t limit)
+    {
+        unsigned long long fields[3];
+        if (!in.read(reinterpret_cast<char*>(fields), sizeof(fields)) || fields[1] > limit || fields[2] > limit)
+            return false;
+        whole = fields[0] != 0;
+        first.resize(static_cast<size_t>(fields[1]));
+        last.resize(static_cast<size_t>(fields[2]));
+        in.read(first.data(), static_cast<std::streamsize>(first.length()));
+        in.read(last.data(), static_cast<std::streamsize>(last.length()));
+        return !in.fail();
+    }
+};
+
+// Counts of one contiguous byte range. Ranges counted apart combine with
+// Merge() into exactly the counts of reading them one after another, so
+// the edges keep what a neighbouring range needs: whether the range starts
+// or ends inside a word, and its first and last pattern length - 1
+// bytes for substring matches that span the border (at least three for
+// UTF-8 sequences that do).
+class FileCounter
+{
+private:
+    bool lines = false;
+    bool words = false;
+    bool chars = false;
+    bool substrings = false;
+    bool freq = false;
+    bool distinctWords = false;
+    bool distinctLines = false;
+    bool heavyWords = false;
+    bool heavyLines = false;
+    bool lengths = false;
+    bool utf8 = true;
+    std::shared_ptr<const PatternCounter> matcher;
+    // Hits of the matcher, kept between blocks
+    std::vector<unsigned long long> matcherScratch;
+    size_t edgeLength = 0;
+
+    unsigned long long bytesCount = 0;
+    unsigned long long linesCount = 0;
+    unsigned long long wordsCount = 0;
+    unsigned long long charsCount = 0;
+    std::vector<unsigned long long> substringsCount;
+    bool startsInWord = false;
+    bool isempty = false;
+    bool utf8Error = false;
+    // Bit i is set while byte i of the range has not been checked against
+    // the three bytes before it
+    unsigned utf8Pending = 0;
+    // First and last edgeLength bytes of the range
+    std::string head;
+    std::string tail;
+    // Words and lines that may continue past the range are kept out of
+    // the table and sketches until a neighbour or the end closes them
+    WordTable frequencies;
+    HyperLogLog wordSketch;
+    HyperLogLog lineSketch;
+    HeavyHitters wordHitters;
+    HeavyHitters lineHitters;
+    TokenEdges wordEdges;
+    TokenEdges lineEdges;
+    // Lengths of the lines within the range, and of those at its ends the
+    // same way as lineEdges
+    LengthHistogram lineLengths;
+    unsigned long long firstLength = 0;
+    unsigned long long lastLength = 0;
+    bool oneLine = false;
+    // Where the time goes, with --stats only
+    FileStats* stats = nullptr;
+    // Hash of what the counter was made with, which decides its state
+    unsigned long long shape = 0;
+
+    static constexpr size_t MaxWordLength = 1024;
+    static constexpr size_t MaxLineLength = 64 * 1024;
+
+    void LinesCount(std::string_view block)
+    {
+        linesCount += Kernels.countByte(block.data(), block.size(), '\n');
+    }
+
+    void AppendLengths(bool nextWhole, unsigned long long nextFirst, unsigned long long nextLast)
+    {
+        if (bytesCount == 0)
+        {
+            oneLine = nextWhole;
+            firstLength = nextFirst;
+            lastLength = nextLast;
+            return;
+        }
+        if (oneLine)
+        {
+            firstLength += nextFirst;
+            if (!nextWhole)
+            {
+                oneLine = false;
+                lastLength = nextLast;
+            }
+            return;
+        }
+        lastLength += nextFirst;
+        if (nextWhole)
+            return;
+        lineLengths.Add(lastLength);
+        lastLength = nextLast;
+    }
+
+    // Newlines are found 64 bytes at a time from the positions in the mask
+    // of newline bytes, and the lines between them go by their distance
+    void LengthsCount(std::string_view block)
+    {
+        const char* data = block.data();
+        size_t size = block.size();
+        bool found = false;
+        size_t firstEnd = 0;
+        size_t start = 0;
+        for (size_t base = 0; base < size; base += 64)
+        {
+            size_t length = std::min<size_t>(64, size - base);
+            unsigned long long mask = length == 64 ? Kernels.byteMask(data + base, '\n') : ByteMaskScalar(data + base, length, '\n');
+            while (mask)
+            {
+                size_t pos = base + static_cast<size_t>(__builtin_ctzll(mask));
+                mask &= mask - 1;
+                if (found)
+                    lineLengths.Add(pos - start);
+                else
+                    firstEnd = pos;
+                found = true;
+                start = pos + 1;
+            }
+        }
+        if (found)
+            AppendLengths(false, firstEnd, size - start);
+        else
+            AppendLengths(true, size, 0);
+    }
+
+    void WordsCount(std::string_view block)
+    {
+        if (bytesCount == 0)
+            startsInWord = !SpaceTable[static_cast<unsigned char>(block[0])];
+        wordsCount += Kernels.countWordStarts(block.data(), block.size(), isempty);
+    }
+
+    // Checks the first bytes of the following range whose pending bits are
+    // set. Those still within the first three bytes of this range have no
+    // full context yet and stay pending.
+    void ValidateBorder(std::string_view nextHead, unsigned nextPending)
+    {
+        unsigned char stitched[6] = {};
+        size_t before = static_cast<size_t>(std::min<unsigned long long>(3, bytesCount));
+        memcpy(stitched, tail.data() + tail.length() - before, before);
+        size_t after = std::min<size_t>(3, nextHead.length());
+        memcpy(stitched + before, nextHead.data(), after);
+        for (size_t pos = 0; pos < after; pos++)
+        {
+            if (!(nextPending & (1u << pos)))
+                continue;
+            size_t at = before + pos;
+            if (bytesCount + pos < 3)
+                utf8Pending |= 1u << (bytesCount + pos);
+            else
+                utf8Error |= Utf8ErrorAt(stitched[at - 3], stitched[at - 2], stitched[at - 1], stitched[at]);
+        }
+    }
+
+    void CharsCount(std::string_view block)
+    {
+        if (!utf8)
+        {
+            for (char sim : block)
+            {
+                if (PrintTable[static_cast<unsigned char>(sim)])
+                    charsCount++;
+            }
+            return;
+        }
+        charsCount += Kernels.countUtf8(block.data(), block.size());
+        if (block.length() > 3)
+        {
+            const unsigned char* context = reinterpret_cast<const unsigned char*>(block.data());
+            utf8Error |= !Kernels.validateUtf8(block.data() + 3, block.length() - 3, context);
+        }
+        ValidateBorder(block, 7);
+    }
+
+    // Adds the matches that start in tail and end in the bytes that follow
+    // it: those found in the stitched edges minus those that lie entirely on
+    // one side of the border
+    void CrossingCount(std::string_view next)
+    {
+        if (tail.empty() || next.empty())
+            return;
+        next = next.substr(0, matcher->MaxLength() - 1);
+        std::string stitched = tail;
+        stitched.append(next);
+        std::vector<unsigned long long> inside(substringsCount.size(), 0);
+        matcher->Count(tail, inside.data(), matcherScratch);
+        matcher->Count(next, inside.data(), matcherScratch);
+        matcher->Count(stitched, substringsCount.data(), matcherScratch);
+        for (size_t index = 0; index < inside.size(); index++)
+            substringsCount[index] -= inside[index];
+    }
+
+    void AppendEdges(std::string_view nextHead, std::string_view nextTail)
+    {
+        if (head.length() < edgeLength)
+            head.append(nextHead.substr(0, edgeLength - head.length()));
+        if (nextTail.length() >= edgeLength)
+        {
+            tail.assign(nextTail.substr(nextTail.length() - edgeLength));
+        }
+        else
+        {
+            tail.append(nextTail);
+            tail.erase(0, tail.length() - std::min(tail.length(), edgeLength));
+        }
+    }
+
+    void SubstringCount(std::string_view block)
+    {
+        CrossingCount(block);
+        matcher->Count(block, substringsCount.data(), matcherScratch);
+    }
+
+    bool WordTokens() const
+    {
+        return freq || distinctWords || heavyWords;
+    }
+
+    bool LineTokens() const
+    {
+        return distinctLines || heavyLines;
+    }
+
+    void CountWord(std::string_view word)
+    {
+        unsigned long long hash = HashWord(word.data(), word.length());
+        if (freq)
+            frequencies.Add(word, 1, hash);
+        if (distinctWords)
+            wordSketch.Add(hash);
+        if (heavyWords)
+            wordHitters.Add(word, hash);
+    }
+
+    void CountLine(std::string_view line)
+    {
+        if (distinctLines)
+            lineSketch.Add(HashWord(line.data(), std::min(line.length(), MaxLineLength)));
+        if (heavyLines)
+            lineHitters.Add(line, HeavyHitters::Hash(line));
+    }
+
+    void AppendWords(bool nextWhole, std::string_view nextFirst, std::string_view nextLast)
+    {
+        wordEdges.Append(bytesCount == 0, MaxWordLength, nextWhole, nextFirst, nextLast,
+                         [this](const std::string& word)
+                         {
+                             if (!word.empty())
+                                 CountWord(word);
+                         });
+    }
+
+    // Every line is closed by its newline, so unlike words an empty line
+    // counts as well
+    void AppendLines(bool nextWhole, std::string_view nextFirst, std::string_view nextLast)
+    {
+        lineEdges.Append(bytesCount == 0, MaxLineLength, nextWhole, nextFirst, nextLast,
+                         [this](const std::string& line) { CountLine(line); });
+    }
+
+    // Words are split at the SpaceTable class, the same as for WordsCount,
+    // and found 64 bytes at a time from the edges of the word-byte mask
+    void WordScan(std::string_view block)
+    {
+        const char* data = block.data();
+        size_t size = block.size();
+        size_t start = 0;
+        size_t firstEnd = size;
+        bool first = true;
+        // As if a word came before the block, so that a space at its start
+        // ends an empty first word
+        unsigned long long carry = 1;
+        for (size_t base = 0; base < size; base += 64)
+        {
+            size_t length = std::min<size_t>(64, size - base);
+            unsigned long long mask = length == 64 ? Kernels.wordMask(data + base) : WordMaskScalar(data + base, length);
+            unsigned long long edges = mask ^ (mask << 1 | carry);
+            if (length < 64)
+                edges &= (1ULL << length) - 1;
+            carry = mask >> 63;
+            while (edges)
+            {
+                size_t bit = static_cast<size_t>(__builtin_ctzll(edges));
+                edges &= edges - 1;
+                size_t pos = base + bit;
+                if (mask >> bit & 1)
+                {
+                    start = pos;
+                }
+                else if (first)
+                {
+                    firstEnd = pos;
+                    first = false;
+                }
+                else
+                {
+                    CountWord(std::string_view(data + start, std::min(pos - start, MaxWordLength)));
+                }
+            }
+        }
+        if (first)
+        {
+            AppendWords(true, block, std::string_view());
+            return;
+        }
+        bool endsInWord = !SpaceTable[static_cast<unsigned char>(data[size - 1])];
+        AppendWords(false, std::string_view(data, firstEnd),
+                    endsInWord ? std::string_view(data + start, size - start) : std::string_view());
+    }
+
+    void LineScan(std::string_view block)
+    {
+        const char* data = block.data();
+        size_t size = block.size();
+        const char* newline = static_cast<const char*>(memchr(data, '\n', size));
+        if (!newline)
+        {
+            AppendLines(true, block, std::string_view());
+            return;
+        }
+        size_t firstEnd = static_cast<size_t>(newline - data);
+        size_t start = firstEnd + 1;
+        while ((newline = static_cast<const char*>(memchr(data + start, '\n', size - start))))
+        {
+            size_t end = static_cast<size_t>(newline - data);
+            CountLine(std::string_view(data + start, end - start));
+            start = end + 1;
+        }
+        AppendLines(false, std::string_view(data, firstEnd), std::string_view(data + start, size - start));
+    }
+
+    template <typename Pass>
+    void Run(Kernel kernel, Pass pass)
+    {
+        if (!stats)
+        {
+            pass();
+            return;
+        }
+        size_t index = static_cast<size_t>(kernel);
+        unsigned long long before[HwEventCount];
+        bool hardware = stats->hardware && ThreadPerfCounters().Read(before);
+        StatsClock::time_point start = StatsClock::now();
+        pass();
+        stats->kernels[index].fetch_add(NanosecondsSince(start), std::memory_order_relaxed);
+        unsigned long long after[HwEventCount];
+        if (!hardware || !ThreadPerfCounters().Read(after))
+            return;
+        for (size_t event = 0; event < HwEventCount; event++)
+            stats->events[index][event].fetch_add(after[event] - before[event], std::memory_order_relaxed);
+    }
+
+    void Feed(std::string_view block)
+    {
+        if (block.empty())
+            return;
+        if (WordTokens())
+            Run(Kernel::WORD_TOKENS, [&]() { WordScan(block); });
+        if (LineTokens())
+            Run(Kernel::LINE_TOKENS, [&]() { LineScan(block); });
+        if (lengths)
+            Run(Kernel::LINE_LENGTHS, [&]() { LengthsCount(block); });
+        if (lines)
+            Run(Kernel::LINES, [&]() { LinesCount(block); });
+        if (words)
+            Run(Kernel::WORDS, [&]() { WordsCount(block); });
+        if (chars)
+            Run(Kernel::CHARS, [&]() { CharsCount(block); });
+        if (substrings)
+            Run(Kernel::SUBSTRINGS, [&]() { SubstringCount(block); });
+        AppendEdges(block, block);
+        bytesCount += block.size();
+    }
+public:
+    FileCounter(const std::vector<Options>& options, const std::vector<std::string>& patterns, const CountSettings& settings)
+        : utf8(settings.encoding == Encoding::UTF8)
+    {
+        for (Options option : options)
+        {
+            switch (option)
+            {
+                case Options::LINES:
+                    lines = true;
+                    break;
+                case Options::WORDS:
+                    words = true;
+                    break;
+                case Options::CHARS:
+                    chars = true;
+                    break;
+                case Options::SUBSTRING:
+                    substrings = true;
+                    break;
+                case Options::BYTES:
+                    break;
+                case Options::FREQ:
+                    freq = true;
+                    break;
+                case Options::DISTINCT_WORDS:
+                    distinctWords = true;
+                    wordSketch = HyperLogLog(settings.hllPrecision);
+                    break;
+                case Options::DISTINCT_LINES:
+                    distinctLines = true;
+                    lineSketch = HyperLogLog(settings.hllPrecision);
+                    break;
+                case Options::HEAVY_WORDS:
+                    heavyWords = true;
+                    wordHitters = HeavyHitters(settings.heavyMemory, settings.topHeavyWords);
+                    break;
+                case Options::HEAVY_LINES:
+                    heavyLines = true;
+                    lineHitters = HeavyHitters(settings.heavyMemory, settings.topHeavyLines);
+                    break;
+                case Options::MAX_LINE_LENGTH:
+                case Options::LINE_HISTOGRAM:
+                    lengths = true;
+                    break;
+                case Options::COMPRESSED_BYTES:
+                    // Comes from the stored file, not from the counters
+                    break;
+            }
+        }
+        if (substrings)
+        {
+            if (patterns.empty())
+                throw InvalidModifier("Modifier for --substring can not be empty");
+            matcher = MakePatternCounter(patterns);
+            substringsCount.assign(patterns.size(), 0);
+            edgeLength = matcher->MaxLength() - 1;
+        }
+        if (chars && utf8)
+            edgeLength = std::max<size_t>(edgeLength, 3);
+        // Every setting the counters above were sized with goes in here
+        unsigned long long sizes[] = { lines, words, chars, substrings, freq, distinctWords, distinctLines,
+                                       heavyWords, heavyLines, lengths, utf8, edgeLength,
+                                       wordSketch.Precision(), lineSketch.Precision(),
+                                       wordHitters.Shape(), lineHitters.Shape() };
+        shape = HashBytes(sizes, sizeof(sizes));
+        for (const std::string& pattern : patterns)
+        {
+            unsigned long long length = pattern.length();
+            shape = HashBytes(&length, sizeof(length), shape);
+            shape = HashBytes(pattern.data(), pattern.length(), shape);
+        }
+    }
+
+    bool NeedsScan() const
+    {
+        return lines || words || chars || substrings || WordTokens() || LineTokens() || lengths;
+    }
+
+    // Times and counts of the blocks this counter is fed go to stats,
+    // none when it is null
+    void SetStats(FileStats* fileStats)
+    {
+        stats = fileStats;
+    }
+
+    // Reads the input once and updates every selected counter block by block
+    void Count(InputReader& reader)
+    {
+        std::string_view block;
+        if (!stats)
+        {
+            while (reader.Read(block))
+                Feed(block);
+            return;
+        }
+        while (true)
+        {
+            StatsClock::time_point start = StatsClock::now();
+            bool more = reader.Read(block);
+            stats->wait.fetch_add(NanosecondsSince(start), std::memory_order_relaxed);
+            if (!more)
+                break;
+            stats->refills.fetch_add(1, std::memory_order_relaxed);
+            stats->bytes.fetch_add(block.size(), std::memory_order_relaxed);
+            Feed(block);
+        }
+    }
+
+    // Appends the counts of the range that directly follows this one
+    void Merge(const FileCounter& next)
+    {
+        if (next.bytesCount == 0)
+            return;
+        if (bytesCount == 0)
+        {
+            *this = next;
+            return;
+        }
+        linesCount += next.linesCount;
+        wordsCount += next.wordsCount;
+        if (isempty && next.startsInWord)
+            wordsCount--;
+        isempty = next.isempty;
+        charsCount += next.charsCount;
+        if (chars && utf8)
+        {
+            utf8Error |= next.utf8Error;
+            ValidateBorder(next.head, next.utf8Pending);
+        }
+        if (substrings)
+        {
+            for (size_t index = 0; index < substringsCount.size(); index++)
+                substringsCount[index] += next.substringsCount[index];
+            CrossingCount(next.head);
+        }
+        if (freq)
+            frequencies.Merge(next.frequencies);
+        if (distinctWords)
+            wordSketch.Merge(next.wordSketch);
+        if (heavyWords)
+            wordHitters.Merge(next.wordHitters);
+        if (WordTokens())
+            AppendWords(next.wordEdges.whole, next.wordEdges.first, next.wordEdges.last);
+        if (distinctLines)
+            lineSketch.Merge(next.lineSketch);
+        if (heavyLines)
+            lineHitters.Merge(next.lineHitters);
+        if (LineTokens())
+            AppendLines(next.lineEdges.whole, next.lineEdges.first, next.lineEdges.last);
+        if (lengths)
+        {
+            lineLengths.Merge(next.lineLengths);
+            AppendLengths(next.oneLine, next.firstLength, next.lastLength);
+        }
+        AppendEdges(next.head, next.tail);
+        bytesCount += next.bytesCount;
+    }
+
+    unsigned long long GetCount(Options option) const
+    {
+        switch (option)
+        {
+            case Options::LINES:
+                // The end of input closes the last line
+                return linesCount + 1;
+            case Options::WORDS:
+                return wordsCount;
+            case Options::CHARS:
+                return charsCount;
+            case Options::SUBSTRING:
+                return std::accumulate(substringsCount.begin(), substringsCount.end(), 0ULL);
+            case Options::BYTES:
+                return bytesCount;
+            case Options::FREQ:
+            case Options::HEAVY_WORDS:
+            case Options::HEAVY_LINES:
+                // The items themselves come from GetRanked()
+                return 0;
+            case Options::MAX_LINE_LENGTH:
+                return GetLengths().Max();
+            case Options::LINE_HISTOGRAM:
+                // The buckets come from GetLengths()
+                return 0;
+            case Options::DISTINCT_WORDS:
+            case Options::DISTINCT_LINES:
+                return GetSketch(option).Estimate();
+            case Options::COMPRESSED_BYTES:
+                // InputFile::CompressedSize() knows it, the counter does not
+                return 0;
+        }
+        return 0;
+    }
+
+    // The sketch of the whole input, which closes the tokens at both of
+    // its ends
+    HyperLogLog GetSketch(Options option) const
+    {
+        if (option == Options::DISTINCT_WORDS)
+        {
+            HyperLogLog sketch = wordSketch;
+            if (!wordEdges.first.empty())
+                sketch.Add(HashWord(wordEdges.first.data(), wordEdges.first.length()));
+            if (!wordEdges.whole && !wordEdges.last.empty())
+                sketch.Add(HashWord(wordEdges.last.data(), wordEdges.last.length()));
+            return sketch;
+        }
+        HyperLogLog sketch = lineSketch;
+        if (bytesCount == 0)
+            return sketch;
+        if (!lineEdges.whole || !lineEdges.first.empty())
+            sketch.Add(HashWord(lineEdges.first.data(), lineEdges.first.length()));
+        if (!lineEdges.whole && !lineEdges.last.empty())
+            sketch.Add(HashWord(lineEdges.last.data(), lineEdges.last.length()));
+        return sketch;
+    }
+
+    // The line lengths of the whole input, likewise
+    LengthHistogram GetLengths() const
+    {
+        LengthHistogram histogram = lineLengths;
+        if (bytesCount == 0)
+            return histogram;
+        if (!oneLine || firstLength > 0)
+            histogram.Add(firstLength);
+        if (!oneLine && lastLength > 0)
+            histogram.Add(lastLength);
+        return histogram;
+    }
+
+    // The heavy hitters of the whole input, likewise
+    HeavyHitters GetHitters(Options option) const
+    {
+        if (option == Options::HEAVY_WORDS)
+        {
+            HeavyHitters hitters = wordHitters;
+            if (!wordEdges.first.empty())
+                hitters.Add(wordEdges.first, HashWord(wordEdges.first.data(), wordEdges.first.length()));
+            if (!wordEdges.whole && !wordEdges.last.empty())
+                hitters.Add(wordEdges.last, HashWord(wordEdges.last.data(), wordEdges.last.length()));
+            return hitters;
+        }
+        HeavyHitters hitters = lineHitters;
+        if (bytesCount == 0)
+            return hitters;
+        if (!lineEdges.whole || !lineEdges.first.empty())
+            hitters.Add(lineEdges.first, HeavyHitters::Hash(lineEdges.first));
+        if (!lineEdges.whole && !lineEdges.last.empty())
+            hitters.Add(lineEdges.last, HeavyHitters::Hash(lineEdges.last));
+        return hitters;
+    }
+
+    std::map<Options, RankedItems> GetRanked(const CountSettings& settings) const
+    {
+        std::map<Options, RankedItems> ranked;
+        if (freq)
+            ranked[Options::FREQ].items = GetFrequent(settings.topWords);
+        if (heavyWords)
+            ranked[Options::HEAVY_WORDS] = GetHitters(Options::HEAVY_WORDS).Top(settings.topHeavyWords);
+        if (heavyLines)
+            ranked[Options::HEAVY_LINES] = GetHitters(Options::HEAVY_LINES).Top(settings.topHeavyLines);
+        return ranked;
+    }
+
+    // The most frequent words of the whole input, which closes the words
+    // at both of its ends
+    std::vector<std::pair<std::string, unsigned long long>> GetFrequent(size_t top) const
+    {
+        std::vector<std::pair<std::string, unsigned long long>> result = frequencies.Top(top);
+        const std::string& firstWord = wordEdges.first;
+        const std::string& lastWord = wordEdges.last;
+        std::vector<std::string> edges;
+        if (!firstWord.empty())
+            edges.push_back(firstWord);
+        if (!wordEdges.whole && !lastWord.empty())
+            edges.push_back(lastWord);
+        if (edges.size() == 2 && edges[0] == edges[1])
+            edges.pop_back();
+        for (const std::string& word : edges)
+        {
+            unsigned long long count = frequencies.Find(word) + 1 + (firstWord == lastWord && !wordEdges.whole ? 1 : 0);
+            result.erase(std::remove_if(result.begin(), result.end(),
+                                        [&word](const std::pair<std::string, unsigned long long>& entry) { return entry.first == word; }),
+                         result.end());
+            result.emplace_back(word, count);
+        }
+        std::sort(result.begin(), result.end(),
+                  [](const std::pair<std::string, unsigned long long>& left, const std::pair<std::string, unsigned long long>& right)
+                  {
+                      if (left.second != right.second)
+                          return left.second > right.second;
+                      return left.first < right.first;
+                  });
+        if (result.size() > top)
+            result.resize(top);
+        return result;
+    }
+
+    const std::vector<unsigned long long>& GetSubstringCounts() const
+    {
+        return substringsCount;
+    }
+
+    // Counters of equal shape read each other's saved state
+    unsigned long long Shape() const
+    {
+        return shape;
+    }
+
+    // Writes the counts and edges, which Load() reads back into a counter
+    // of the same shape
+    void Save(std::ostream& out) const
+    {
+        unsigned long long fields[] = { bytesCount, linesCount, wordsCount, charsCount, startsInWord, isempty,
+                                        utf8Error, utf8Pending, substringsCount.size(), head.length(), tail.length() };
+        out.write(reinterpret_cast<const char*>(fields), sizeof(fields));
+        out.write(reinterpret_cast<const char*>(substringsCount.data()),
+                  static_cast<std::streamsize>(substringsCount.size() * sizeof(unsigned long long)));
+        out.write(head.data(), static_cast<std::streamsize>(head.length()));
+        out.write(tail.data(), static_cast<std::streamsize>(tail.length()));
+        if (WordTokens())
+            wordEdges.Save(out);
+        if (freq)
+            frequencies.Save(out);
+        if (distinctWords)
+            wordSketch.Save(out);
+        if (heavyWords)
+            wordHitters.Save(out);
+        if (LineTokens())
+            lineEdges.Save(out);
+        if (distinctLines)
+            lineSketch.Save(out);
+        if (heavyLines)
+            lineHitters.Save(out);
+        if (lengths)
+        {
+            unsigned long long ends[] = { oneLine, firstLength, lastLength };
+            out.write(reinterpret_cast<const char*>(ends), sizeof(ends));
+            lineLengths.Save(out);
+        }
+    }
+
+    bool Load(std::istream& in)
+    {
+        unsigned long long fields[11];
+        if (!in.read(reinterpret_cast<char*>(fields), sizeof(fields)))
+            return false;
+        if (fields[8] != substringsCount.size() || fields[9] > edgeLength || fields[10] > edgeLength)
+            return false;
+        bytesCount = fields[0];
+        linesCount = fields[1];
+        wordsCount = fields[2];
+        charsCount = fields[3];
+        startsInWord = fields[4] != 0;
+        isempty = fields[5] != 0;
+        utf8Error = fields[6] != 0;
+        utf8Pending = static_cast<unsigned>(fields[7]);
+        head.resize(static_cast<size_t>(fields[9]));
+        tail.resize(static_cast<size_t>(fields[10]));
+        in.read(reinterpret_cast<char*>(substringsCount.data()),
+                static_cast<std::streamsize>(substringsCount.size() * sizeof(unsigned long long)));
+        in.read(head.data(), static_cast<std::streamsize>(head.length()));
+        in.read(tail.data(), static_cast<std::streamsize>(tail.length()));
+        if (WordTokens() && !wordEdges.Load(in, MaxWordLength))
+            return false;
+        if (freq && !frequencies.Load(in))
+            return false;
+        if (distinctWords && !wordSketch.Load(in))
+            return false;
+        if (heavyWords && !wordHitters.Load(in))
+            return false;
+        if (LineTokens() && !lineEdges.Load(in, MaxLineLength))
+            return false;
+        if (distinctLines && !lineSketch.Load(in))
+            return false;
+        if (heavyLines && !lineHitters.Load(in))
+            return false;
+        if (lengths)
+        {
+            unsigned long long ends[3];
+            if (!in.read(reinterpret_cast<char*>(ends), sizeof(ends)) || !lineLengths.Load(in))
+                return false;
+            oneLine = ends[0] != 0;
+            firstLength = ends[1];
+            lastLength = ends[2];
+        }
+        return !in.fail();
+    }
+
+    // Whether the whole input, counted from its first byte, is valid UTF-8
+    bool IsUtf8Valid() const
+    {
+        if (!chars || !utf8)
+            return true;
+        if (utf8Error)
+            return false;
+        unsigned char stitched[6] = {};
+        size_t before = static_cast<size_t>(std::min<unsigned long long>(3, bytesCount));
+        memcpy(stitched + 3, head.data(), before);
+        for (size_t pos = 0; pos < before; pos++)
+        {
+            if ((utf8Pending & (1u << pos))
+                && Utf8ErrorAt(stitched[pos], stitched[pos + 1], stitched[pos + 2], stitched[pos + 3]))
+                return false;
+        }
+        // A sequence cut short by the end of input fails like one followed by ASCII
+        unsigned char last[3] = {};
+        memcpy(last + 3 - before, tail.data() + tail.length() - before, before);
+        return !Utf8ErrorAt(last[0], last[1], last[2], 0);
+    }
+};
+
+// Only inputs that were read through know their size from the counter
+inline unsigned long long BytesCount(const InputFile& file, const FileCounter& counter)
+{
+    return file.IsRegular() && !file.IsCompressed() ? file.Size() : counter.GetCount(Options::BYTES);
+}
+
+inline unsigned long long ChooseCounter(Options option, const InputFile& file, const FileCounter& counter)
+{
+    switch (option)
+    {
+        case Options::BYTES:
+            return BytesCount(file, counter);
+        default:
+            return counter.GetCount(option);
+    }
+}
+
+// Runs tasks on a fixed set of worker threads. A pool without workers runs
+// every task on the calling thread as soon as it is submitted.
+class ThreadPool
+{
+private:
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> tasks;
+    std::mutex lock;
+    std::condition_variable wakeup;
+    bool stopping = false;
+
+    void Work()
+    {
+        while (true)
+        {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                wakeup.wait(guard, [this]() { return stopping || !tasks.empty(); });
+                if (tasks.empty())
+                    return;
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+public:
+    explicit ThreadPool(unsigned threads)
+    {
+        for (unsigned worker = 0; worker < threads; worker++)
+            workers.emplace_back(&ThreadPool::Work, this);
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        wakeup.notify_all();
+        for (std::thread& worker : workers)
+            worker.join();
+    }
+
+    void Submit(std::function<void()> task)
+    {
+        if (workers.empty())
+        {
+            task();
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            tasks.push_back(std::move(task));
+        }
+        wakeup.notify_one();
+    }
+};
+
+// What is printed for one file
+struct FileResult
+{
+    std::string filename;
+    bool opened = false;
+    std::map<Options, unsigned long long> filedata;
+    std::vector<unsigned long long> substrings;
+    bool utf8Valid = true;
+    std::map<Options, RankedItems> ranked;
+    // Sketches behind the --distinct-* and --heavy-* results, for
+    // directory subtotals
+    std::map<Options, HyperLogLog> sketches;
+    std::map<Options, HeavyHitters> hitters;
+    LengthHistogram lengths;
+    // False when a compressed file turned out broken or truncated
+    bool intact = true;
+    // Errno of a read that failed, which leaves the counts short
+    int readError = 0;
+    // With --follow, the open file and the state to go on counting from
+    std::shared_ptr<InputFile> file;
+    std::shared_ptr<FileCounter> counter;
+    // With --stats, where the time of the file went
+    std::shared_ptr<FileStats> stats;
+};
+
+// Everything besides the file that decides its counts
+inline unsigned long long OptionsHash(const std::vector<Options>& options, const std::vector<std::string>& patterns, Encoding encoding)
+{
+    std::vector<int> sorted;
+    for (Options option : options)
+        sorted.push_back(static_cast<int>(option));
+    std::sort(sorted.begin(), sorted.end());
+    sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+    sorted.push_back(-1 - static_cast<int>(encoding));
+    unsigned long long hash = HashBytes(sorted.data(), sorted.size() * sizeof(int));
+    for (const std::string& pattern : patterns)
+    {
+        unsigned long long length = pattern.length();
+        hash = HashBytes(&length, sizeof(length), hash);
+        hash = HashBytes(pattern.data(), pattern.length(), hash);
+    }
+    return hash;
+}
+
+// Counts of files that did not change since they were last counted with
+// the same options, kept in a memory-mapped open-addressing table that
+// several invocations share. A file is identified by device, inode, size
+// and modification time. Lookups hold a shared flock(2), stores an
+// exclusive one; threads of one process also take a mutex, since flock
+// does not separate them. When all slots of a probe window are taken the
+// least recently used of them is replaced, which approximates LRU over
+// the whole table within the size budget.
+class ResultCache
+{
+public:
+    struct Key
+    {
+        unsigned long long device;
+        unsigned long long inode;
+        unsigned long long size;
+        unsigned long long mtime;
+    };
+private:
+    static constexpr unsigned long long Magic = 0x3145484341434357ULL;
+    static constexpr unsigned Version = 1;
+    static constexpr size_t ProbeWindow = 8;
+    static constexpr size_t MaxPatterns = 8;
+    static constexpr size_t OptionCount = 5;
+
+    struct Header
+    {
+        unsigned long long magic;
+        unsigned long long version;
+        unsigned long long entrySize;
+        unsigned long long slots;
+        // Ticks of the LRU clock
+        unsigned long long clock;
+    };
+
+    struct Entry
+    {
+        // Hash of every field but lastUsed, zero for a free slot
+        unsigned long long check;
+        Key key;
+        unsigned long long optionsHash;
+        unsigned long long lastUsed;
+        unsigned long long counts[OptionCount];
+        unsigned long long substrings[MaxPatterns];
+        unsigned long long utf8Valid;
+    };
+
+    int fd = -1;
+    char* mapping = nullptr;
+    size_t mappingSize = 0;
+    unsigned long long slots = 0;
+    unsigned long long optionsHash = 0;
+    const std::vector<Options>& options;
+    size_t patterns;
+    std::mutex lock;
+
+    Header& GetHeader() const
+    {
+        return *reinterpret_cast<Header*>(mapping);
+    }
+
+    Entry* Entries() const
+    {
+        return reinterpret_cast<Entry*>(mapping + sizeof(Header));
+    }
+
+    bool Valid() const
+    {
+        const Header& header = GetHeader();
+        return header.magic == Magic && header.version == Version && header.entrySize == sizeof(Entry)
+            && header.slots == slots;
+    }
+
+    static unsigned long long Check(const Entry& entry)
+    {
+        unsigned long long hash = HashBytes(&entry.key, sizeof(entry.key) + sizeof(entry.optionsHash));
+        hash = HashBytes(entry.counts, sizeof(entry.counts) + sizeof(entry.substrings) + sizeof(entry.utf8Valid), hash);
+        return hash | 1;
+    }
+
+    bool Matches(const Entry& entry, const Key& key) const
+    {
+        return entry.check != 0 && entry.optionsHash == optionsHash && entry.key.device == key.device
+            && entry.key.inode == key.inode && entry.key.size == key.size && entry.key.mtime == key.mtime;
+    }
+
+    size_t Home(const Key& key) const
+    {
+        return static_cast<size_t>(HashBytes(&key, sizeof(key), optionsHash) & (slots - 1));
+    }
+
+    class FileLock
+    {
+    private:
+        int fd;
+    public:
+        FileLock(int fd, int operation)
+            : fd(fd)
+        {
+            while (flock(fd, operation) != 0 && errno == EINTR)
+            {
+            }
+        }
+
+        ~FileLock()
+        {
+            flock(fd, LOCK_UN);
+        }
+    };
+public:
+    ResultCache(const std::string& path, unsigned long long budget, const std::vector<Options>& options,
+                const std::vector<std::string>& patternList, Encoding encoding)
+        : optionsHash(OptionsHash(options, patternList, encoding)), options(options), patterns(patternList.size())
+    {
+        slots = 1;
+        while (sizeof(Header) + slots * 2 * sizeof(Entry) <= budget)
+            slots *= 2;
+        mappingSize = sizeof(Header) + slots * sizeof(Entry);
+
+        fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0)
+            throw InvalidModifier("File for --cache can not be opened");
+        {
+            // A file of another layout or budget is started over
+            FileLock guard(fd, LOCK_EX);
+            struct stat info;
+            Header header {};
+            bool reset = fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) != mappingSize
+                || pread(fd, &header, sizeof(header), 0) != static_cast<ssize_t>(sizeof(header))
+                || header.magic != Magic || header.version != Version || header.entrySize != sizeof(Entry)
+                || header.slots != slots;
+            if (reset)
+            {
+                header = { Magic, Version, sizeof(Entry), slots, 0 };
+                if (ftruncate(fd, 0) != 0 || ftruncate(fd, static_cast<off_t>(mappingSize)) != 0
+                    || pwrite(fd, &header, sizeof(header), 0) != static_cast<ssize_t>(sizeof(header)))
+                    throw InvalidModifier("File for --cache can not be written");
+            }
+        }
+        void* data = mmap(nullptr, mappingSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED)
+            throw InvalidModifier("File for --cache can not be mapped");
+        mapping = static_cast<char*>(data);
+    }
+
+    ResultCache(const ResultCache&) = delete;
+    ResultCache& operator=(const ResultCache&) = delete;
+
+    ~ResultCache()
+    {
+        if (mapping)
+            munmap(mapping, mappingSize);
+        if (fd >= 0)
+            close(fd);
+    }
+
+    static Key MakeKey(const struct stat& info)
+    {
+        return { static_cast<unsigned long long>(info.st_dev), static_cast<unsigned long long>(info.st_ino),
+                 static_cast<unsigned long long>(info.st_size),
+                 static_cast<unsigned long long>(info.st_mtim.tv_sec) * 1000000000ULL
+                     + static_cast<unsigned long long>(info.st_mtim.tv_nsec) };
+    }
+
+    // Per-pattern counts have room for a few patterns only, and word
+    // lists and sketches for none
+    bool Usable() const
+    {
+        for (Options option : options)
+        {
+            if (option == Options::FREQ || option == Options::DISTINCT_WORDS || option == Options::DISTINCT_LINES
+                || option == Options::HEAVY_WORDS || option == Options::HEAVY_LINES
+                || option == Options::MAX_LINE_LENGTH || option == Options::LINE_HISTOGRAM)
+                return false;
+        }
+        return patterns <= MaxPatterns;
+    }
+
+    bool Lookup(const Key& key, FileResult& result)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        FileLock shared(fd, LOCK_SH);
+        // Another invocation may have started the file over with another budget
+        if (!Valid())
+            return false;
+        size_t home = Home(key);
+        for (size_t probe = 0; probe < ProbeWindow; probe++)
+        {
+            Entry& entry = Entries()[(home + probe) & (slots - 1)];
+            if (entry.check == 0)
+                return false;
+            if (!Matches(entry, key) || Check(entry) != entry.check)
+                continue;
+            for (Options option : options)
+                result.filedata[option] = entry.counts[static_cast<size_t>(option)];
+            result.substrings.assign(entry.substrings, entry.substrings + patterns);
+            result.utf8Valid = entry.utf8Valid != 0;
+            // Readers race on the clock only to order evictions, so relaxed updates do
+            unsigned long long now = __atomic_add_fetch(&GetHeader().clock, 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&entry.lastUsed, now, __ATOMIC_RELAXED);
+            return true;
+        }
+        return false;
+    }
+
+    void Store(const Key& key, const FileResult& result)
+    {
+        Entry fresh {};
+        fresh.key = key;
+        fresh.optionsHash = optionsHash;
+        for (auto pair_option_count : result.filedata)
+            fresh.counts[static_cast<size_t>(pair_option_count.first)] = pair_option_count.second;
+        for (size_t index = 0; index < patterns && index < result.substrings.size(); index++)
+            fresh.substrings[index] = result.substrings[index];
+        fresh.utf8Valid = result.utf8Valid;
+        fresh.check = Check(fresh);
+
+        std::lock_guard<std::mutex> guard(lock);
+        FileLock exclusive(fd, LOCK_EX);
+        if (!Valid())
+            return;
+        size_t home = Home(key);
+        Entry* victim = nullptr;
+        for (size_t probe = 0; probe < ProbeWindow; probe++)
+        {
+            Entry& entry = Entries()[(home + probe) & (slots - 1)];
+            // An older version of the same file is replaced in place
+            if (entry.check == 0 || (entry.optionsHash == optionsHash && entry.key.device == key.device
+                                     && entry.key.inode == key.inode))
+            {
+                victim = &entry;
+                break;
+            }
+            if (!victim || entry.lastUsed < victim->lastUsed)
+                victim = &entry;
+        }
+        fresh.lastUsed = ++GetHeader().clock;
+        *victim = fresh;
+    }
+};
+
+// The counter state of a file after its first offset bytes, so that a
+// file that only grew since is counted from there on. A checkpoint is
+// found by device, inode and the shape of the counter, and holds the last bytes before its
+// offset: a file that shrank, was rewritten or replaced by another inode
+// is counted from the start again.
+class CheckpointStore
+{
+private:
+    // Raised whenever the saved state changes meaning, such as word hashes
+    static constexpr unsigned long long Magic = 0x34504b4354434357ULL;
+    static constexpr size_t VerifyLength = 4096;
+
+    std::string directory;
+    unsigned long long shape;
+
+    std::string Path(const struct stat& info) const
+    {
+        unsigned long long identity[] = { static_cast<unsigned long long>(info.st_dev),
+                                          static_cast<unsigned long long>(info.st_ino) };
+        unsigned long long hash = HashBytes(identity, sizeof(identity), shape);
+        char name[32];
+        snprintf(name, sizeof(name), "%016llx.ckpt", hash);
+        return directory + "/" + name;
+    }
+
+    static std::string Bytes(const InputFile& file, unsigned long long begin, unsigned long long end)
+    {
+        std::string bytes;
+        std::unique_ptr<InputReader> reader = file.Read(begin, end);
+        std::string_view block;
+        while (reader->Read(block))
+            bytes.append(block);
+        return bytes;
+    }
+public:
+    // Checkpoints are kept for counters of the shape of prototype
+    CheckpointStore(const std::string& directory, const FileCounter& prototype)
+        : directory(directory), shape(prototype.Shape())
+    {
+    }
+
+    // Loads the state of the file up to its checkpoint into counter and
+    // returns the offset to go on from, 0 without a usable checkpoint
+    unsigned long long Resume(const InputFile& file, FileCounter& counter) const
+    {
+        std::ifstream in(Path(file.Info()), std::ios::binary);
+        unsigned long long fields[5];
+        if (!in.read(reinterpret_cast<char*>(fields), sizeof(fields)))
+            return 0;
+        unsigned long long offset = fields[3];
+        const struct stat& info = file.Info();
+        if (fields[0] != Magic || fields[1] != shape || fields[2] != static_cast<unsigned long long>(info.st_ino)
+            || offset > file.Size() || fields[4] > std::min<unsigned long long>(offset, VerifyLength))
+            return 0;
+        std::string stored(static_cast<size_t>(fields[4]), '\0');
+        if (!in.read(stored.data(), static_cast<std::streamsize>(stored.length())))
+            return 0;
+        if (Bytes(file, offset - stored.length(), offset) != stored)
+            return 0;
+        FileCounter loaded = counter;
+        if (!loaded.Load(in) || loaded.GetCount(Options::BYTES) != offset)
+            return 0;
+        counter = std::move(loaded);
+        return offset;
+    }
+
+    // Written next to the checkpoint and renamed over it, so that a reader
+    // never sees half of one
+    void Save(const InputFile& file, const FileCounter& counter) const
+    {
+        unsigned long long offset = counter.GetCount(Options::BYTES);
+        std::string verify = Bytes(file, offset - std::min<unsigned long long>(offset, VerifyLength), offset);
+        std::string path = Path(file.Info());
+        std::string temporary = path + "." + std::to_string(getpid()) + "." + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+        {
+            std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+            unsigned long long fields[] = { Magic, shape, static_cast<unsigned long long>(file.Info().st_ino),
+                                            offset, verify.length() };
+            out.write(reinterpret_cast<const char*>(fields), sizeof(fields));
+            out.write(verify.data(), static_cast<std::streamsize>(verify.length()));
+            counter.Save(out);
+            out.close();
+            if (out.fail())
+            {
+                unlink(temporary.c_str());
+                return;
+            }
+        }
+        if (rename(temporary.c_str(), path.c_str()) != 0)
+            unlink(temporary.c_str());
+    }
+};
+
+// Counts files on a thread pool and gives the results back in the order
+// the files were added. Large regular files are also split into byte
+// ranges that are counted as separate tasks and merged in file order.
+class FileScheduler
+{
+private:
+    static constexpr unsigned long long MinRangeSize = 1 << 20;
+
+    struct Slot
+    {
+        FileResult result;
+        bool done = false;
+    };
+
+    struct RangeJob
+    {
+        std::shared_ptr<InputFile> file;
+        std::vector<FileCounter> partials;
+        std::atomic<unsigned> remaining;
+
+        // The state before the first range
+        FileCounter base;
+
+        // Ranges go from one bound to the next
+        std::vector<unsigned long long> bounds;
+
+        RangeJob(std::shared_ptr<InputFile> file, std::vector<unsigned long long> bounds, const FileCounter& counter,
+                 FileCounter base)
+            : file(std::move(file)), partials(bounds.size() - 1, counter), remaining(static_cast<unsigned>(bounds.size() - 1)),
+              base(std::move(base)), bounds(std::move(bounds))
+        {
+        }
+    };
+
+    const FileCounter& prototype;
+    const std::vector<Options>& options;
+    const CountSettings& settings;
+    ResultCache* cache;
+    const CheckpointStore* checkpoints;
+    // Slots are only appended and popped from the front, so references stay valid
+    std::deque<Slot> slots;
+    std::mutex lock;
+    std::condition_variable ready;
+    ThreadPool pool;
+
+    void Finish(Slot& slot, const std::shared_ptr<InputFile>& opened, const FileCounter& counter)
+    {
+        const InputFile& file = *opened;
+        FileResult result;
+        result.opened = true;
+        for (Options option : options)
+            result.filedata[option] = ChooseCounter(option, file, counter);
+        if (file.IsCompressed() && result.filedata.count(Options::BYTES))
+            result.filedata[Options::COMPRESSED_BYTES] = file.CompressedSize();
+        result.intact = !file.IsCorrupt();
+        result.readError = file.ReadError();
+        result.substrings = counter.GetSubstringCounts();
+        result.utf8Valid = counter.IsUtf8Valid();
+        result.ranked = counter.GetRanked(settings);
+        result.lengths = counter.GetLengths();
+        for (Options option : { Options::DISTINCT_WORDS, Options::DISTINCT_LINES })
+        {
+            if (result.filedata.count(option))
+                result.sketches[option] = counter.GetSketch(option);
+        }
+        for (Options option : { Options::HEAVY_WORDS, Options::HEAVY_LINES })
+        {
+            if (settings.recursive && result.filedata.count(option))
+                result.hitters[option] = counter.GetHitters(option);
+        }
+        // Counts of compressed files are not cached nor resumed, and those
+        // files are not followed: their counter state is not one of stored
+        // bytes. Neither are counts that a failed read cut short.
+        if (result.readError)
+        {
+            Publish(slot, std::move(result));
+            return;
+        }
+        if (cache && file.IsRegular() && !file.IsCompressed() && counter.NeedsScan())
+            Remember(file, result);
+        if (checkpoints && file.IsRegular() && !file.IsCompressed() && counter.NeedsScan())
+            checkpoints->Save(file, counter);
+        if (settings.follow && file.IsRegular() && !file.IsCompressed())
+        {
+            result.file = opened;
+            result.counter = std::make_shared<FileCounter>(counter);
+            result.counter->SetStats(nullptr);
+        }
+        Publish(slot, std::move(result));
+    }
+
+    void Publish(Slot& slot, FileResult result)
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            result.filename = std::move(slot.result.filename);
+            result.stats = std::move(slot.result.stats);
+            if (result.stats)
+                result.stats->wall = NanosecondsSince(result.stats->started);
+            slot.result = std::move(result);
+            slot.done = true;
+        }
+        ready.notify_all();
+    }
+
+    // Stores counts only of a file that did not change while it was read
+    // and whose modification time is old enough that a write within the
+    // same timestamp tick can not go unnoticed
+    void Remember(const InputFile& file, const FileResult& result)
+    {
+        struct stat current;
+        if (!file.Restat(current))
+            return;
+        ResultCache::Key key = ResultCache::MakeKey(file.Info());
+        ResultCache::Key now = ResultCache::MakeKey(current);
+        if (key.device != now.device || key.inode != now.inode || key.size != now.size || key.mtime != now.mtime)
+            return;
+        if (current.st_mtim.tv_sec + 1 >= time(nullptr))
+            return;
+        cache->Store(key, result);
+    }
+
+    void Fail(Slot& slot)
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            slot.done = true;
+        }
+        ready.notify_all();
+    }
+
+    void CountSlot(Slot& slot)
+    {
+        FileStats* stats = nullptr;
+        if (settings.stats)
+        {
+            slot.result.stats = std::make_shared<FileStats>();
+            stats = slot.result.stats.get();
+            stats->hardware = settings.hardwareStats;
+        }
+        auto file = std::make_shared<InputFile>();
+        bool opened = file->Open(slot.result.filename, settings, stats);
+        if (stats)
+            stats->open = NanosecondsSince(stats->started);
+        if (!opened)
+        {
+            Fail(slot);
+            return;
+        }
+        // Followed files need the counter state, which the cache does not keep
+        if (cache && file->IsRegular() && !file->IsCompressed() && prototype.NeedsScan() && !settings.follow)
+        {
+            FileResult cached;
+            if (cache->Lookup(ResultCache::MakeKey(file->Info()), cached))
+            {
+                cached.opened = true;
+                Publish(slot, std::move(cached));
+                return;
+            }
+        }
+        FileCounter counted = prototype;
+        counted.SetStats(stats);
+        // Only what follows the checkpoint of a grown file is read
+        FileCounter base = counted;
+        unsigned long long start = 0;
+        if (checkpoints && file->IsRegular() && !file->IsCompressed() && prototype.NeedsScan())
+            start = checkpoints->Resume(*file, base);
+        unsigned long long size = file->IsRegular() ? file->Size() - start : 0;
+        unsigned ranges = static_cast<unsigned>(std::min<unsigned long long>(settings.jobs, std::max(1ULL, size / MinRangeSize)));
+        std::vector<unsigned long long> bounds;
+        for (unsigned range = 0; range <= ranges; range++)
+            bounds.push_back(start + size * range / ranges);
+        // A compressed file splits only where frames start
+        if (file->IsCompressed() && ranges > 1)
+        {
+            std::vector<unsigned long long> frames = file->Frames();
+            for (unsigned range = 1; range < ranges; range++)
+            {
+                auto frame = std::lower_bound(frames.begin(), frames.end(), bounds[range]);
+                bounds[range] = frame == frames.end() ? start + size : *frame;
+            }
+            bounds.erase(std::unique(bounds.begin(), bounds.end()), bounds.end());
+            ranges = static_cast<unsigned>(bounds.size() - 1);
+        }
+        if (!prototype.NeedsScan() || ranges <= 1)
+        {
+            FileCounter counter = counted;
+            // A stream has to be read through even just for its size, and
+            // so does a compressed file
+            if (counter.NeedsScan() || !file->IsRegular() || file->IsCompressed())
+            {
+                std::unique_ptr<InputReader> reader = file->IsRegular() ? file->Read(start, file->Size()) : file->Read();
+                counter.Count(*reader);
+            }
+            base.Merge(counter);
+            Finish(slot, file, base);
+            return;
+        }
+
+        auto job = std::make_shared<RangeJob>(file, std::move(bounds), counted, std::move(base));
+        for (unsigned range = 0; range < ranges; range++)
+        {
+            pool.Submit([this, &slot, job, range]()
+            {
+                std::unique_ptr<InputReader> reader = job->file->Read(job->bounds[range], job->bounds[range + 1]);
+                job->partials[range].Count(*reader);
+                // The last range to finish merges all of them
+                if (job->remaining.fetch_sub(1) == 1)
+                {
+                    FileCounter counter = std::move(job->base);
+                    for (const FileCounter& partial : job->partials)
+                        counter.Merge(partial);
+                    Finish(slot, job->file, counter);
+                }
+            });
+        }
+    }
+public:
+    FileScheduler(const FileCounter& prototype, const std::vector<Options>& options, const CountSettings& settings,
+                  ResultCache* cache, const CheckpointStore* checkpoints)
+        : prototype(prototype), options(options), settings(settings), cache(cache), checkpoints(checkpoints),
+          pool(settings.jobs > 1 ? settings.jobs : 0)
+    {
+    }
+
+    void Add(const std::string& filename)
+    {
+        Slot* slot;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            slots.emplace_back();
+            slot = &slots.back();
+            slot->result.filename = filename;
+        }
+        pool.Submit([this, slot]() { CountSlot(*slot); });
+    }
+
+    // Waits for the oldest file that was not taken yet
+    FileResult Take()
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        ready.wait(guard, [this]() { return slots.front().done; });
+        FileResult result = std::move(slots.front().result);
+        slots.pop_front();
+        return result;
+    }
+};
+
+#endif